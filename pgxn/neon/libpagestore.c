@@ -24,7 +24,14 @@
 
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "portability/instr_time.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
 #include "utils/guc.h"
+#include "utils/timestamp.h"
 
 #include "neon.h"
 #include "walproposer.h"
@@ -42,20 +49,396 @@ PGconn	   *pageserver_conn = NULL;
 
 char	   *page_server_connstring_raw;
 
+/*
+ * Request statistics in shared memory. Each counter is updated with atomic
+ * operations, so that recording a request doesn't need any locks.
+ */
+typedef struct
+{
+	pg_atomic_uint64 requests;
+	pg_atomic_uint64 bytes_sent;
+	pg_atomic_uint64 bytes_received;
+	pg_atomic_uint64 latency_us;
+	pg_atomic_uint64 latency_buckets[PS_STAT_LATENCY_BUCKETS];
+} PagestoreSharedStats;
+
+static PagestoreSharedStats *pagestore_shared_stats = NULL;
+
+/*
+ * Trace of recent requests and responses, in a ring buffer in shared memory.
+ *
+ * Logging every request with PageStoreTrace is far too expensive to enable
+ * in production, so this keeps the last neon.request_trace_size requests in
+ * binary form instead, to be able to look at them after the fact with
+ * neon_request_trace().
+ *
+ * The ring is lock-free. A writer claims a slot by incrementing write_pos,
+ * and marks the slot as being written by zeroing its sequence number, which
+ * is set to the (1-based) position in the ring after the record has been
+ * filled in. A reader copies a record only if its sequence number is the one
+ * it expects both before and after the copy, so that records that are being
+ * overwritten concurrently are skipped rather than returned half-written.
+ */
+typedef struct
+{
+	pg_atomic_uint64 seq;
+	PagestoreTraceRecord record;
+} PagestoreTraceEntry;
+
+typedef struct
+{
+	pg_atomic_uint64 write_pos;
+	PagestoreTraceEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} PagestoreTrace;
+
+static int	request_trace_size;
+static PagestoreTrace *pagestore_trace = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/*
+ * Requests that have been sent, but whose response has not been received
+ * yet. The page server responds in the same order, so this is a FIFO queue.
+ * There can be at most one primary request and MAX_PREFETCH_REQUESTS
+ * prefetch requests in flight.
+ */
+#define MAX_INFLIGHT_REQUESTS 256
+
+typedef struct
+{
+	PagestoreStatType type;
+	bool		prefetch;		/* sent after the primary request of a batch */
+	instr_time	sent_at;
+
+	/* details of the request, for the request trace */
+	NeonMessageTag tag;
+	bool		latest;
+	XLogRecPtr	lsn;
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+} InflightRequest;
+
+static InflightRequest inflight_requests[MAX_INFLIGHT_REQUESTS];
+static int	inflight_head = 0;
+static int	n_inflight_requests = 0;
+
+/*
+ * Number of requests sent since the last flush. When several requests are
+ * sent in one batch, the first one is the page we need right now, and the
+ * rest are prefetch requests.
+ */
+static int	n_unflushed_requests = 0;
+
+/*
+ * Wait event to report while waiting for the response to the oldest
+ * in-flight request.
+ */
+static uint32
+pageserver_receive_wait_event(void)
+{
+	InflightRequest *inflight;
+
+	if (n_inflight_requests == 0)
+		return WAIT_EVENT_NEON_PS_GETPAGE;
+
+	inflight = &inflight_requests[inflight_head];
+	if (inflight->type != PS_STAT_GET_PAGE)
+		return WAIT_EVENT_NEON_PS_RELMETADATA;
+	else if (inflight->prefetch)
+		return WAIT_EVENT_NEON_PS_PREFETCH;
+	else
+		return WAIT_EVENT_NEON_PS_GETPAGE;
+}
+
+static PagestoreStatType
+pagestore_request_stat_type(NeonMessageTag tag)
+{
+	switch (tag)
+	{
+		case T_NeonExistsRequest:
+			return PS_STAT_EXISTS;
+		case T_NeonNblocksRequest:
+			return PS_STAT_NBLOCKS;
+		case T_NeonGetPageRequest:
+			return PS_STAT_GET_PAGE;
+		case T_NeonDbSizeRequest:
+			return PS_STAT_DBSIZE;
+		default:
+			elog(ERROR, "unexpected request tag 0x%02x", tag);
+	}
+	return PS_STAT_NUM_TYPES;	/* keep compiler quiet */
+}
+
+/*
+ * Account one request of the given type in the shared statistics. Returns
+ * the latency of the request in microseconds.
+ */
+static uint64
+pagestore_record_request(PagestoreStatType type, instr_time *start,
+						 uint64 bytes_received)
+{
+	PagestoreSharedStats *stats;
+	instr_time	elapsed;
+	uint64		latency_us;
+	int			bucket;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, *start);
+	latency_us = INSTR_TIME_GET_MICROSEC(elapsed);
+
+	if (pagestore_shared_stats == NULL)
+		return latency_us;
+	stats = &pagestore_shared_stats[type];
+
+	if (latency_us < 16)
+		bucket = 0;
+	else
+		bucket = Min(pg_leftmost_one_pos64(latency_us) - 3, PS_STAT_LATENCY_BUCKETS - 1);
+
+	pg_atomic_fetch_add_u64(&stats->requests, 1);
+	pg_atomic_fetch_add_u64(&stats->bytes_received, bytes_received);
+	pg_atomic_fetch_add_u64(&stats->latency_us, latency_us);
+	pg_atomic_fetch_add_u64(&stats->latency_buckets[bucket], 1);
+
+	return latency_us;
+}
+
+/*
+ * Add a request and its response to the request trace.
+ */
+static void
+pagestore_trace_request(InflightRequest *inflight, NeonResponse *resp,
+						uint64 latency_us)
+{
+	PagestoreTraceEntry *entry;
+	PagestoreTraceRecord *record;
+	uint64		pos;
+
+	if (pagestore_trace == NULL)
+		return;
+
+	pos = pg_atomic_fetch_add_u64(&pagestore_trace->write_pos, 1);
+	entry = &pagestore_trace->entries[pos % request_trace_size];
+
+	pg_atomic_write_u64(&entry->seq, 0);
+	pg_write_barrier();
+
+	record = &entry->record;
+	record->seq = pos + 1;
+	record->time = GetCurrentTimestamp();
+	record->pid = MyProcPid;
+	record->request_tag = inflight->tag;
+	record->response_tag = resp->tag;
+	record->prefetch = inflight->prefetch;
+	record->latest = inflight->latest;
+	record->lsn = inflight->lsn;
+	record->rnode = inflight->rnode;
+	record->forknum = inflight->forknum;
+	record->blkno = inflight->blkno;
+	record->latency_us = latency_us;
+	switch (resp->tag)
+	{
+		case T_NeonExistsResponse:
+			record->result = ((NeonExistsResponse *) resp)->exists;
+			break;
+		case T_NeonNblocksResponse:
+			record->result = ((NeonNblocksResponse *) resp)->n_blocks;
+			break;
+		case T_NeonDbSizeResponse:
+			record->result = ((NeonDbSizeResponse *) resp)->db_size;
+			break;
+		default:
+			record->result = 0;
+			break;
+	}
+
+	pg_write_barrier();
+	pg_atomic_write_u64(&entry->seq, pos + 1);
+}
+
+/*
+ * Get a copy of the request trace, oldest request first. Returns the number
+ * of records stored in *records. Records that were being overwritten while
+ * we read them are left out.
+ */
+int
+pagestore_get_trace(PagestoreTraceRecord * *records)
+{
+	uint64		end;
+	uint64		start;
+	int			n = 0;
+
+	*records = NULL;
+	if (pagestore_trace == NULL)
+		return 0;
+
+	end = pg_atomic_read_u64(&pagestore_trace->write_pos);
+	start = end > request_trace_size ? end - request_trace_size : 0;
+	if (end == start)
+		return 0;
+
+	*records = palloc((end - start) * sizeof(PagestoreTraceRecord));
+	for (uint64 pos = start; pos < end; pos++)
+	{
+		PagestoreTraceEntry *entry = &pagestore_trace->entries[pos % request_trace_size];
+
+		if (pg_atomic_read_u64(&entry->seq) != pos + 1)
+			continue;
+		pg_read_barrier();
+		(*records)[n] = entry->record;
+		pg_read_barrier();
+		if (pg_atomic_read_u64(&entry->seq) != pos + 1)
+			continue;
+		n++;
+	}
+	return n;
+}
+
+const char *
+pagestore_stat_type_name(PagestoreStatType type)
+{
+	switch (type)
+	{
+		case PS_STAT_EXISTS:
+			return "exists";
+		case PS_STAT_NBLOCKS:
+			return "nblocks";
+		case PS_STAT_GET_PAGE:
+			return "get_page";
+		case PS_STAT_DBSIZE:
+			return "dbsize";
+		case PS_STAT_CONNECT:
+			return "connect";
+		case PS_STAT_NUM_TYPES:
+			break;
+	}
+	return "unknown";
+}
+
+/*
+ * Get a snapshot of the statistics of one request type. Returns false if the
+ * statistics are not available, because the library was not loaded with
+ * shared_preload_libraries.
+ */
+bool
+pagestore_get_stats(PagestoreStatType type, PagestoreStats * stats)
+{
+	PagestoreSharedStats *shared;
+
+	if (pagestore_shared_stats == NULL)
+		return false;
+	shared = &pagestore_shared_stats[type];
+
+	/*
+	 * pagestore_record_request() counts the request before its bucket, so
+	 * reading the buckets first guarantees that the histogram never adds up
+	 * to more than 'requests'.
+	 */
+	for (int i = 0; i < PS_STAT_LATENCY_BUCKETS; i++)
+		stats->latency_buckets[i] = pg_atomic_read_u64(&shared->latency_buckets[i]);
+	pg_read_barrier();
+	stats->requests = pg_atomic_read_u64(&shared->requests);
+	stats->bytes_sent = pg_atomic_read_u64(&shared->bytes_sent);
+	stats->bytes_received = pg_atomic_read_u64(&shared->bytes_received);
+	stats->latency_us = pg_atomic_read_u64(&shared->latency_us);
+
+	return true;
+}
+
+static Size
+pagestore_trace_size(void)
+{
+	return add_size(offsetof(PagestoreTrace, entries),
+					mul_size(request_trace_size, sizeof(PagestoreTraceEntry)));
+}
+
+static Size
+pagestore_shmem_size(void)
+{
+	Size		size = mul_size(PS_STAT_NUM_TYPES, sizeof(PagestoreSharedStats));
+
+	if (request_trace_size > 0)
+		size = add_size(size, pagestore_trace_size());
+	return size;
+}
+
+static void
+pagestore_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	pagestore_shared_stats = ShmemInitStruct("neon pagestore stats",
+											 pagestore_shmem_size(),
+											 &found);
+	if (!found)
+	{
+		for (int type = 0; type < PS_STAT_NUM_TYPES; type++)
+		{
+			PagestoreSharedStats *stats = &pagestore_shared_stats[type];
+
+			pg_atomic_init_u64(&stats->requests, 0);
+			pg_atomic_init_u64(&stats->bytes_sent, 0);
+			pg_atomic_init_u64(&stats->bytes_received, 0);
+			pg_atomic_init_u64(&stats->latency_us, 0);
+			for (int i = 0; i < PS_STAT_LATENCY_BUCKETS; i++)
+				pg_atomic_init_u64(&stats->latency_buckets[i], 0);
+		}
+	}
+	if (request_trace_size > 0)
+	{
+		pagestore_trace = ShmemInitStruct("neon pagestore trace",
+										  pagestore_trace_size(),
+										  &found);
+		if (!found)
+		{
+			pg_atomic_init_u64(&pagestore_trace->write_pos, 0);
+			for (int i = 0; i < request_trace_size; i++)
+				pg_atomic_init_u64(&pagestore_trace->entries[i].seq, 0);
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * shmem_request hook: request additional shared resources.  We'll allocate or
+ * attach to the shared resources in pagestore_shmem_startup().
+ */
+static void
+pagestore_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(pagestore_shmem_size());
+}
+#endif
+
 static void
 pageserver_connect()
 {
 	char	   *query;
 	int			ret;
+	instr_time	start;
 
 	Assert(!connected);
 
+	INSTR_TIME_SET_CURRENT(start);
 	pageserver_conn = PQconnectdb(page_server_connstring);
 
 	if (PQstatus(pageserver_conn) == CONNECTION_BAD)
 	{
 		char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
 
+		pagestore_record_request(PS_STAT_CONNECT, &start, 0);
 		PQfinish(pageserver_conn);
 		pageserver_conn = NULL;
 		ereport(ERROR,
@@ -68,6 +451,7 @@ pageserver_connect()
 	ret = PQsendQuery(pageserver_conn, query);
 	if (ret != 1)
 	{
+		pagestore_record_request(PS_STAT_CONNECT, &start, 0);
 		PQfinish(pageserver_conn);
 		pageserver_conn = NULL;
 		neon_log(ERROR, "could not send pagestream command to pageserver");
@@ -82,7 +466,7 @@ pageserver_connect()
 							   WL_LATCH_SET | WL_SOCKET_READABLE |
 							   WL_EXIT_ON_PM_DEATH,
 							   PQsocket(pageserver_conn),
-							   -1L, PG_WAIT_EXTENSION);
+							   -1L, WAIT_EVENT_NEON_PS_CONNECT);
 		ResetLatch(MyLatch);
 
 		CHECK_FOR_INTERRUPTS();
@@ -94,6 +478,7 @@ pageserver_connect()
 			{
 				char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
 
+				pagestore_record_request(PS_STAT_CONNECT, &start, 0);
 				PQfinish(pageserver_conn);
 				pageserver_conn = NULL;
 
@@ -105,6 +490,8 @@ pageserver_connect()
 
 	neon_log(LOG, "libpagestore: connected to '%s'", page_server_connstring_raw);
 
+	pagestore_record_request(PS_STAT_CONNECT, &start, 0);
+	n_inflight_requests = 0;
 	connected = true;
 }
 
@@ -112,7 +499,7 @@ pageserver_connect()
  * A wrapper around PQgetCopyData that checks for interrupts while sleeping.
  */
 static int
-call_PQgetCopyData(PGconn *conn, char **buffer)
+call_PQgetCopyData(PGconn *conn, char **buffer, uint32 wait_event_info)
 {
 	int			ret;
 
@@ -128,7 +515,7 @@ retry:
 							   WL_LATCH_SET | WL_SOCKET_READABLE |
 							   WL_EXIT_ON_PM_DEATH,
 							   PQsocket(conn),
-							   -1L, PG_WAIT_EXTENSION);
+							   -1L, wait_event_info);
 		ResetLatch(MyLatch);
 
 		CHECK_FOR_INTERRUPTS();
@@ -164,6 +551,8 @@ pageserver_disconnect(void)
 		PQfinish(pageserver_conn);
 		pageserver_conn = NULL;
 		connected = false;
+		n_inflight_requests = 0;
+		n_unflushed_requests = 0;
 	}
 }
 
@@ -200,7 +589,52 @@ pageserver_send(NeonRequest * request)
 		pageserver_disconnect();
 		neon_log(ERROR, "failed to send page request: %s", msg);
 	}
+
+	if (n_inflight_requests < MAX_INFLIGHT_REQUESTS)
+	{
+		InflightRequest *inflight;
+
+		inflight = &inflight_requests[(inflight_head + n_inflight_requests) % MAX_INFLIGHT_REQUESTS];
+		inflight->type = pagestore_request_stat_type(request->tag);
+		inflight->prefetch = n_unflushed_requests > 0;
+		INSTR_TIME_SET_CURRENT(inflight->sent_at);
+		inflight->tag = request->tag;
+		inflight->latest = request->latest;
+		inflight->lsn = request->lsn;
+		inflight->forknum = InvalidForkNumber;
+		inflight->blkno = InvalidBlockNumber;
+		switch (request->tag)
+		{
+			case T_NeonExistsRequest:
+				inflight->rnode = ((NeonExistsRequest *) request)->rnode;
+				inflight->forknum = ((NeonExistsRequest *) request)->forknum;
+				break;
+			case T_NeonNblocksRequest:
+				inflight->rnode = ((NeonNblocksRequest *) request)->rnode;
+				inflight->forknum = ((NeonNblocksRequest *) request)->forknum;
+				break;
+			case T_NeonGetPageRequest:
+				inflight->rnode = ((NeonGetPageRequest *) request)->rnode;
+				inflight->forknum = ((NeonGetPageRequest *) request)->forknum;
+				inflight->blkno = ((NeonGetPageRequest *) request)->blkno;
+				break;
+			case T_NeonDbSizeRequest:
+				inflight->rnode.spcNode = InvalidOid;
+				inflight->rnode.dbNode = ((NeonDbSizeRequest *) request)->dbNode;
+				inflight->rnode.relNode = InvalidOid;
+				break;
+			default:
+				break;
+		}
+		n_inflight_requests++;
+
+		/* Account the request size now, we don't keep the request around */
+		if (pagestore_shared_stats != NULL)
+			pg_atomic_fetch_add_u64(&pagestore_shared_stats[inflight->type].bytes_sent,
+									req_buff.len);
+	}
 	pfree(req_buff.data);
+	n_unflushed_requests++;
 
 	if (message_level_is_interesting(PageStoreTrace))
 	{
@@ -220,7 +654,8 @@ pageserver_receive(void)
 	PG_TRY();
 	{
 		/* read response */
-		resp_buff.len = call_PQgetCopyData(pageserver_conn, &resp_buff.data);
+		resp_buff.len = call_PQgetCopyData(pageserver_conn, &resp_buff.data,
+										   pageserver_receive_wait_event());
 		resp_buff.cursor = 0;
 
 		if (resp_buff.len < 0)
@@ -233,6 +668,24 @@ pageserver_receive(void)
 		resp = nm_unpack_response(&resp_buff);
 		PQfreemem(resp_buff.data);
 
+		/*
+		 * Account the request that this is the response to. The latency is
+		 * measured from sending the request until the response is consumed,
+		 * which for prefetched pages includes the time until the page was
+		 * actually needed.
+		 */
+		if (n_inflight_requests > 0)
+		{
+			InflightRequest *inflight = &inflight_requests[inflight_head];
+			uint64		latency_us;
+
+			latency_us = pagestore_record_request(inflight->type, &inflight->sent_at,
+												  resp_buff.len);
+			pagestore_trace_request(inflight, resp, latency_us);
+			inflight_head = (inflight_head + 1) % MAX_INFLIGHT_REQUESTS;
+			n_inflight_requests--;
+		}
+
 		if (message_level_is_interesting(PageStoreTrace))
 		{
 			char	   *msg = nm_to_string((NeonMessage *) resp);
@@ -255,6 +708,7 @@ pageserver_receive(void)
 static void
 pageserver_flush(void)
 {
+	n_unflushed_requests = 0;
 	if (PQflush(pageserver_conn))
 	{
 		char	   *msg = PQerrorMessage(pageserver_conn);
@@ -428,7 +882,27 @@ pg_init_libpagestore(void)
 							GUC_UNIT_MB,
 							NULL, NULL, NULL);
 
+	DefineCustomIntVariable("neon.request_trace_size",
+							"Sets the number of recent page server requests kept for neon_request_trace()",
+							"Zero disables the request trace.",
+							&request_trace_size,
+							4096, 0, INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
 	relsize_hash_init();
+	wallog_cache_init();
+	statement_stats_init();
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pagestore_shmem_request;
+#else
+	RequestAddinShmemSpace(pagestore_shmem_size());
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pagestore_shmem_startup;
 
 	if (page_server != NULL)
 		neon_log(ERROR, "libpagestore already loaded");
@@ -22,3 +22,168 @@ AS 'MODULE_PATHNAME', 'backpressure_throttling_time'
 LANGUAGE C STRICT
 PARALLEL UNSAFE;
 
+-- Number of backpressure sleeps by the lag limit that caused them, and
+-- histogram of their durations: sleep_histogram[1] counts sleeps shorter
+-- than 256 us, sleep_histogram[i] sleeps below 2^(i+7) us, and the last
+-- element the longer ones.
+CREATE FUNCTION backpressure_throttling_stats(
+    OUT write_lag_throttles bigint,
+    OUT flush_lag_throttles bigint,
+    OUT apply_lag_throttles bigint,
+    OUT sleep_histogram bigint[]
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'backpressure_throttling_stats'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+-- Write, flush and apply lag of the page server behind the local flush
+-- position, in bytes, sampled once a second over the last 10 minutes.
+-- NULL if the page server has not reported the position yet.
+CREATE FUNCTION backpressure_lag_history(
+    OUT sample_time timestamptz,
+    OUT write_lag bigint,
+    OUT flush_lag bigint,
+    OUT apply_lag bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'backpressure_lag_history'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+
+-- Statistics of the walproposer connections to the safekeepers, one row per
+-- safekeeper. flush_lag_us is the age of the oldest AppendRequest the
+-- safekeeper has not acknowledged yet. The append round trip time is from
+-- sending an AppendRequest until the safekeeper acknowledges flushing it:
+-- rtt_histogram[1] counts round trips faster than 16 us, rtt_histogram[i]
+-- those below 2^(i+3) us, and the last element the slower ones. Only
+-- superusers and members of pg_monitor can call it.
+CREATE FUNCTION neon_safekeeper_stats(
+    OUT safekeeper text,
+    OUT state text,
+    OUT flush_lsn pg_lsn,
+    OUT flush_lag_bytes bigint,
+    OUT flush_lag_us bigint,
+    OUT bytes_sent bigint,
+    OUT reconnects bigint,
+    OUT avg_rtt_us bigint,
+    OUT rtt_histogram bigint[],
+    OUT last_error text,
+    OUT last_error_time timestamptz
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'neon_safekeeper_stats'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+REVOKE ALL ON FUNCTION neon_safekeeper_stats() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION neon_safekeeper_stats() TO pg_monitor;
+
+-- Statistics of requests to the page server, one row per request type.
+-- 'connect' counts connection attempts, including failed ones.
+-- latency_histogram[1] counts requests that took less than 16 us,
+-- latency_histogram[i] requests below 2^(i+3) us, and the last element
+-- everything slower. The histogram never adds up to more than 'requests', but
+-- may lag behind it while other backends are recording requests.
+CREATE FUNCTION neon_smgr_stats(
+    OUT request_type text,
+    OUT requests bigint,
+    OUT bytes_sent bigint,
+    OUT bytes_received bigint,
+    OUT latency_us bigint,
+    OUT latency_histogram bigint[]
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'neon_smgr_stats'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+-- Number of pages in the cache of force-logged VM and FSM pages, and how
+-- often evicted pages were found there with the same contents (hits), so
+-- that they were not WAL-logged again. All zeros if neon.wallog_cache_size
+-- is 0.
+CREATE FUNCTION neon_wallog_cache_stats(
+    OUT entries bigint,
+    OUT hits bigint,
+    OUT misses bigint,
+    OUT evictions bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'neon_wallog_cache_stats'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+-- Like the wait_event_type and wait_event columns of pg_stat_activity, but
+-- with the wait events of the neon extension shown by name rather than as
+-- a generic "Extension" wait. Only superusers and members of pg_monitor can
+-- call it.
+CREATE FUNCTION neon_backend_wait_events(
+    OUT pid integer,
+    OUT wait_event_type text,
+    OUT wait_event text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'neon_backend_wait_events'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+REVOKE ALL ON FUNCTION neon_backend_wait_events() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION neon_backend_wait_events() TO pg_monitor;
+
+-- Page server reads per statement, in the spirit of pg_stat_statements.
+-- queryid matches the queryid of pg_stat_statements and pg_stat_activity.
+-- Statements are tracked up to neon.stat_statements_max.
+CREATE FUNCTION neon_get_stat_statements(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT getpage_requests bigint,
+    OUT prefetch_hits bigint,
+    OUT bytes_received bigint,
+    OUT wait_time_us bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'neon_get_stat_statements'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE VIEW neon_stat_statements AS
+    SELECT * FROM neon_get_stat_statements();
+
+CREATE FUNCTION neon_stat_statements_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'neon_stat_statements_reset'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+REVOKE ALL ON FUNCTION neon_stat_statements_reset() FROM PUBLIC;
+
+-- Recent requests to the page server and their responses, oldest first, from
+-- all backends. The number of requests kept is set by
+-- neon.request_trace_size. 'result' is the response to exists, nblocks and
+-- dbsize requests. Only superusers and members of pg_monitor can call it.
+CREATE FUNCTION neon_request_trace(
+    OUT seq bigint,
+    OUT response_time timestamptz,
+    OUT pid integer,
+    OUT request text,
+    OUT prefetch boolean,
+    OUT lsn pg_lsn,
+    OUT latest boolean,
+    OUT spcnode oid,
+    OUT dbnode oid,
+    OUT relnode oid,
+    OUT forknum integer,
+    OUT blkno bigint,
+    OUT latency_us bigint,
+    OUT response text,
+    OUT result bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'neon_request_trace'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+REVOKE ALL ON FUNCTION neon_request_trace() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION neon_request_trace() TO pg_monitor;
@@ -15,31 +15,202 @@
 #include "access/xlog.h"
 #include "storage/buf_internals.h"
 #include "storage/bufmgr.h"
+#include "catalog/pg_authid.h"
 #include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "executor/instrument.h"
 #include "replication/walsender.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
 #include "funcapi.h"
+#include "miscadmin.h"
 #include "access/htup_details.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/backend_status.h"
+#include "utils/builtins.h"
 #include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
 #include "utils/guc.h"
+#include "utils/tuplestore.h"
+#include "utils/wait_event.h"
+#include "tcop/tcopprot.h"
 
 #include "neon.h"
+#include "pagestore_client.h"
 #include "walproposer.h"
+#include "walproposer_utils.h"
 
 PG_MODULE_MAGIC;
 void		_PG_init(void);
 
+static bool explain_pageserver_io = false;
+static ExplainOneQuery_hook_type prev_ExplainOneQuery_hook = NULL;
+
+static void neon_ExplainOneQuery(Query *query, int cursorOptions,
+								 IntoClause *into, ExplainState *es,
+								 const char *queryString, ParamListInfo params,
+								 QueryEnvironment *queryEnv);
+
 void
 _PG_init(void)
 {
 	pg_init_libpagestore();
 	pg_init_walproposer();
 
+	DefineCustomBoolVariable("neon.explain_pageserver_io",
+							 "Show page server I/O in EXPLAIN (ANALYZE, BUFFERS) output",
+							 NULL,
+							 &explain_pageserver_io,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	prev_ExplainOneQuery_hook = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = neon_ExplainOneQuery;
+
 	EmitWarningsOnPlaceholders("neon");
 }
 
+/*
+ * ExplainOneQuery hook that reports the page server I/O done by the query.
+ *
+ * Shared buffer misses in the BUFFERS output don't tell whether the page
+ * came from the local file cache, from a prefetched response, or had to be
+ * fetched from the page server with a full round trip. With
+ * neon.explain_pageserver_io, EXPLAIN (ANALYZE, BUFFERS) adds a line with
+ * the page server requests issued by the query, and the time spent waiting
+ * for them.
+ *
+ * The numbers are for the whole query, not per plan node, and don't include
+ * the I/O done by parallel workers. Only the text format is supported.
+ */
+static void
+neon_ExplainOneQuery(Query *query, int cursorOptions,
+					 IntoClause *into, ExplainState *es,
+					 const char *queryString, ParamListInfo params,
+					 QueryEnvironment *queryEnv)
+{
+	bool		show_io;
+	NeonIOUsage io_start;
+
+	show_io = explain_pageserver_io && es->analyze && es->buffers &&
+		es->format == EXPLAIN_FORMAT_TEXT;
+	if (show_io)
+		io_start = neonIOUsage;
+
+	if (prev_ExplainOneQuery_hook)
+		prev_ExplainOneQuery_hook(query, cursorOptions, into, es,
+								  queryString, params, queryEnv);
+	else
+	{
+		/* Same as standard ExplainOneQuery() */
+		PlannedStmt *plan;
+		instr_time	planstart,
+					planduration;
+		BufferUsage bufusage_start,
+					bufusage;
+
+		if (es->buffers)
+			bufusage_start = pgBufferUsage;
+		INSTR_TIME_SET_CURRENT(planstart);
+
+		plan = pg_plan_query(query, queryString, cursorOptions, params);
+
+		INSTR_TIME_SET_CURRENT(planduration);
+		INSTR_TIME_SUBTRACT(planduration, planstart);
+
+		if (es->buffers)
+		{
+			memset(&bufusage, 0, sizeof(BufferUsage));
+			BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+		}
+
+		ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+					   &planduration, (es->buffers ? &bufusage : NULL));
+	}
+
+	if (show_io)
+	{
+		instr_time	wait_time = neonIOUsage.wait_time;
+
+		INSTR_TIME_SUBTRACT(wait_time, io_start.wait_time);
+		appendStringInfo(es->str,
+						 "Pageserver I/O: getpage=%lld prefetch=%lld prefetch_hits=%lld prefetch_wasted=%lld wait=%.3f ms\n",
+						 (long long) (neonIOUsage.getpage_requests - io_start.getpage_requests),
+						 (long long) (neonIOUsage.prefetch_requests - io_start.prefetch_requests),
+						 (long long) (neonIOUsage.prefetch_hits - io_start.prefetch_hits),
+						 (long long) (neonIOUsage.prefetch_wasted - io_start.prefetch_wasted),
+						 INSTR_TIME_GET_MILLISEC(wait_time));
+	}
+}
+
 PG_FUNCTION_INFO_V1(pg_cluster_size);
 PG_FUNCTION_INFO_V1(backpressure_lsns);
 PG_FUNCTION_INFO_V1(backpressure_throttling_time);
+PG_FUNCTION_INFO_V1(backpressure_throttling_stats);
+PG_FUNCTION_INFO_V1(backpressure_lag_history);
+PG_FUNCTION_INFO_V1(neon_safekeeper_stats);
+PG_FUNCTION_INFO_V1(neon_smgr_stats);
+PG_FUNCTION_INFO_V1(neon_wallog_cache_stats);
+PG_FUNCTION_INFO_V1(neon_backend_wait_events);
+PG_FUNCTION_INFO_V1(neon_get_stat_statements);
+PG_FUNCTION_INFO_V1(neon_stat_statements_reset);
+PG_FUNCTION_INFO_V1(neon_request_trace);
+
+/*
+ * Prepare a set-returning function to return its result in a tuplestore.
+ */
+static Tuplestorestate *
+neon_init_materialized_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * Build an int8[] array out of an array of counters.
+ */
+static Datum
+neon_counters_to_array(uint64 *counters, int n)
+{
+	Datum	   *elems = palloc(n * sizeof(Datum));
+
+	for (int i = 0; i < n; i++)
+		elems[i] = Int64GetDatum((int64) counters[i]);
+
+	return PointerGetDatum(construct_array(elems, n, INT8OID,
+										   sizeof(int64), FLOAT8PASSBYVAL,
+										   TYPALIGN_DOUBLE));
+}
 
 Datum
 pg_cluster_size(PG_FUNCTION_ARGS)
@@ -85,3 +256,362 @@ backpressure_throttling_time(PG_FUNCTION_ARGS)
 {
 	PG_RETURN_UINT64(BackpressureThrottlingTime());
 }
+
+/*
+ * Number of backpressure sleeps by cause, and histogram of their durations.
+ */
+Datum
+backpressure_throttling_stats(PG_FUNCTION_ARGS)
+{
+	uint64		throttles[BACKPRESSURE_NUM_CAUSES];
+	uint64		sleeps[BACKPRESSURE_SLEEP_BUCKETS];
+	Datum		values[BACKPRESSURE_NUM_CAUSES + 1];
+	bool		nulls[BACKPRESSURE_NUM_CAUSES + 1];
+	TupleDesc	tupdesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	BackpressureThrottlingStats(throttles, sleeps);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	for (int i = 0; i < BACKPRESSURE_NUM_CAUSES; i++)
+		values[i] = Int64GetDatum((int64) throttles[i]);
+	values[BACKPRESSURE_NUM_CAUSES] = neon_counters_to_array(sleeps, BACKPRESSURE_SLEEP_BUCKETS);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Replication lag of the page server over the last minutes, oldest first.
+ */
+Datum
+backpressure_lag_history(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = neon_init_materialized_srf(fcinfo, &tupdesc);
+	BackpressureLagSample *samples;
+	int			n;
+
+	samples = palloc(sizeof(BackpressureLagSample) * BACKPRESSURE_LAG_HISTORY_SIZE);
+	n = BackpressureLagHistory(samples);
+
+	for (int i = 0; i < n; i++)
+	{
+		Datum		values[4];
+		bool		nulls[4];
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = TimestampTzGetDatum(samples[i].time);
+		values[1] = Int64GetDatum(samples[i].writeLag);
+		nulls[1] = samples[i].writeLag < 0;
+		values[2] = Int64GetDatum(samples[i].flushLag);
+		nulls[2] = samples[i].flushLag < 0;
+		values[3] = Int64GetDatum(samples[i].applyLag);
+		nulls[3] = samples[i].applyLag < 0;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	pfree(samples);
+
+	return (Datum) 0;
+}
+
+/*
+ * Statistics of the connections to the safekeepers, one row per safekeeper.
+ */
+Datum
+neon_safekeeper_stats(PG_FUNCTION_ARGS)
+{
+#define NEON_SAFEKEEPER_STATS_COLS	11
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = neon_init_materialized_srf(fcinfo, &tupdesc);
+	SafekeeperStats *stats;
+	TimestampTz now;
+	int			n;
+
+	stats = palloc(sizeof(SafekeeperStats) * MAX_SAFEKEEPERS);
+	n = GetSafekeeperStats(stats);
+	now = GetCurrentTimestamp();
+
+	for (int i = 0; i < n; i++)
+	{
+		Datum		values[NEON_SAFEKEEPER_STATS_COLS];
+		bool		nulls[NEON_SAFEKEEPER_STATS_COLS];
+		uint64		responses = 0;
+
+		for (int j = 0; j < SK_STATS_RTT_BUCKETS; j++)
+			responses += stats[i].rttBuckets[j];
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(stats[i].address);
+		values[1] = CStringGetTextDatum(FormatSafekeeperState(stats[i].state));
+		values[2] = LSNGetDatum(stats[i].flushLsn);
+		nulls[2] = (stats[i].flushLsn == InvalidXLogRecPtr);
+		values[3] = Int64GetDatum(stats[i].flushLagBytes);
+		/* Computed here, so that it keeps growing if the safekeeper hangs */
+		values[4] = Int64GetDatum(stats[i].oldestUnflushedAt != 0 ?
+								  Max(now - stats[i].oldestUnflushedAt, 0) : 0);
+		values[5] = Int64GetDatum((int64) stats[i].bytesSent);
+		values[6] = Int64GetDatum((int64) stats[i].reconnects);
+		values[7] = Int64GetDatum(responses > 0 ? (int64) (stats[i].rttTotalUs / responses) : 0);
+		nulls[7] = (responses == 0);
+		values[8] = neon_counters_to_array(stats[i].rttBuckets, SK_STATS_RTT_BUCKETS);
+		values[9] = CStringGetTextDatum(stats[i].lastError);
+		nulls[9] = (stats[i].lastError[0] == '\0');
+		values[10] = TimestampTzGetDatum(stats[i].lastErrorTime);
+		nulls[10] = (stats[i].lastErrorTime == 0);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	pfree(stats);
+
+	return (Datum) 0;
+}
+
+/*
+ * Statistics of requests to the page server, one row per request type.
+ */
+Datum
+neon_smgr_stats(PG_FUNCTION_ARGS)
+{
+#define NEON_SMGR_STATS_COLS	6
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = neon_init_materialized_srf(fcinfo, &tupdesc);
+
+	for (int type = 0; type < PS_STAT_NUM_TYPES; type++)
+	{
+		PagestoreStats stats;
+		Datum		values[NEON_SMGR_STATS_COLS];
+		bool		nulls[NEON_SMGR_STATS_COLS];
+
+		if (!pagestore_get_stats(type, &stats))
+			break;
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(pagestore_stat_type_name(type));
+		values[1] = Int64GetDatum((int64) stats.requests);
+		values[2] = Int64GetDatum((int64) stats.bytes_sent);
+		values[3] = Int64GetDatum((int64) stats.bytes_received);
+		values[4] = Int64GetDatum((int64) stats.latency_us);
+		values[5] = neon_counters_to_array(stats.latency_buckets, PS_STAT_LATENCY_BUCKETS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Number of pages in the cache of force-logged VM and FSM pages, and how
+ * often evicted pages were found in it. All zeros if the cache is disabled.
+ */
+Datum
+neon_wallog_cache_stats(PG_FUNCTION_ARGS)
+{
+	uint64		counters[4] = {0};
+	Datum		values[4];
+	bool		nulls[4];
+	TupleDesc	tupdesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	wallog_cache_get_stats(&counters[0], &counters[1], &counters[2], &counters[3]);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	for (int i = 0; i < 4; i++)
+		values[i] = Int64GetDatum((int64) counters[i]);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Name of a neon wait event, or NULL if it's not one of ours.
+ */
+const char *
+neon_wait_event_name(uint32 wait_event_info)
+{
+	switch (wait_event_info)
+	{
+		case WAIT_EVENT_NEON_PS_CONNECT:
+			return "NeonPageserverConnect";
+		case WAIT_EVENT_NEON_PS_GETPAGE:
+			return "NeonGetPage";
+		case WAIT_EVENT_NEON_PS_PREFETCH:
+			return "NeonPrefetch";
+		case WAIT_EVENT_NEON_PS_RELMETADATA:
+			return "NeonRelMetadata";
+		case WAIT_EVENT_NEON_BACKPRESSURE:
+			return "NeonBackpressure";
+	}
+	return NULL;
+}
+
+/*
+ * Current wait event of each backend, like the wait_event_type and wait_event
+ * columns of pg_stat_activity, but with neon wait events shown by name.
+ */
+Datum
+neon_backend_wait_events(PG_FUNCTION_ARGS)
+{
+#define NEON_BACKEND_WAIT_EVENTS_COLS	3
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = neon_init_materialized_srf(fcinfo, &tupdesc);
+	int			num_backends = pgstat_fetch_stat_numbackends();
+
+	for (int curr_backend = 1; curr_backend <= num_backends; curr_backend++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		PgBackendStatus *beentry;
+		PGPROC	   *proc;
+		uint32		wait_event_info;
+		const char *wait_event_type;
+		const char *wait_event;
+		Datum		values[NEON_BACKEND_WAIT_EVENTS_COLS];
+		bool		nulls[NEON_BACKEND_WAIT_EVENTS_COLS];
+
+		local_beentry = pgstat_fetch_stat_local_beentry(curr_backend);
+		if (local_beentry == NULL)
+			continue;
+		beentry = &local_beentry->backendStatus;
+
+		proc = BackendPidGetProc(beentry->st_procpid);
+		if (proc == NULL)
+			proc = AuxiliaryPidGetProc(beentry->st_procpid);
+		if (proc == NULL)
+			continue;
+
+		wait_event_info = UINT32_ACCESS_ONCE(proc->wait_event_info);
+		wait_event_type = pgstat_get_wait_event_type(wait_event_info);
+		wait_event = neon_wait_event_name(wait_event_info);
+		if (wait_event == NULL)
+			wait_event = pgstat_get_wait_event(wait_event_info);
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(beentry->st_procpid);
+		if (wait_event_type)
+			values[1] = CStringGetTextDatum(wait_event_type);
+		else
+			nulls[1] = true;
+		if (wait_event)
+			values[2] = CStringGetTextDatum(wait_event);
+		else
+			nulls[2] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+typedef struct
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	Oid			userid;
+	bool		is_allowed_role;
+} StatementStatsScanState;
+
+static void
+neon_stat_statements_add_row(Oid userid, Oid dbid, uint64 queryid,
+							 StatementStats * stats, void *arg)
+{
+#define NEON_STAT_STATEMENTS_COLS	7
+	StatementStatsScanState *state = (StatementStatsScanState *) arg;
+	Datum		values[NEON_STAT_STATEMENTS_COLS];
+	bool		nulls[NEON_STAT_STATEMENTS_COLS];
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = ObjectIdGetDatum(userid);
+	values[1] = ObjectIdGetDatum(dbid);
+	/* Like pg_stat_statements, only show query IDs of other users to privileged roles */
+	if (state->is_allowed_role || userid == state->userid)
+		values[2] = Int64GetDatum((int64) queryid);
+	else
+		nulls[2] = true;
+	values[3] = Int64GetDatum(stats->getpage_requests);
+	values[4] = Int64GetDatum(stats->prefetch_hits);
+	values[5] = Int64GetDatum(stats->bytes_received);
+	values[6] = Int64GetDatum(stats->wait_time_us);
+
+	tuplestore_putvalues(state->tupstore, state->tupdesc, values, nulls);
+}
+
+/*
+ * Return the page server reads of each statement, for the
+ * neon_stat_statements view.
+ */
+Datum
+neon_get_stat_statements(PG_FUNCTION_ARGS)
+{
+	StatementStatsScanState state;
+
+	state.tupstore = neon_init_materialized_srf(fcinfo, &state.tupdesc);
+	state.userid = GetUserId();
+	state.is_allowed_role = is_member_of_role(state.userid, ROLE_PG_READ_ALL_STATS);
+
+	statement_stats_scan(neon_stat_statements_add_row, &state);
+
+	return (Datum) 0;
+}
+
+Datum
+neon_stat_statements_reset(PG_FUNCTION_ARGS)
+{
+	statement_stats_reset();
+	PG_RETURN_VOID();
+}
+
+/*
+ * Return the recent requests to the page server, from the request trace.
+ */
+Datum
+neon_request_trace(PG_FUNCTION_ARGS)
+{
+#define NEON_REQUEST_TRACE_COLS	15
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = neon_init_materialized_srf(fcinfo, &tupdesc);
+	PagestoreTraceRecord *records;
+	int			n;
+
+	n = pagestore_get_trace(&records);
+	for (int i = 0; i < n; i++)
+	{
+		PagestoreTraceRecord *record = &records[i];
+		Datum		values[NEON_REQUEST_TRACE_COLS];
+		bool		nulls[NEON_REQUEST_TRACE_COLS];
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum((int64) record->seq);
+		values[1] = TimestampTzGetDatum(record->time);
+		values[2] = Int32GetDatum(record->pid);
+		values[3] = CStringGetTextDatum(nm_tag_name(record->request_tag));
+		values[4] = BoolGetDatum(record->prefetch);
+		values[5] = LSNGetDatum(record->lsn);
+		values[6] = BoolGetDatum(record->latest);
+		values[7] = ObjectIdGetDatum(record->rnode.spcNode);
+		values[8] = ObjectIdGetDatum(record->rnode.dbNode);
+		values[9] = ObjectIdGetDatum(record->rnode.relNode);
+		if (record->forknum != InvalidForkNumber)
+			values[10] = Int32GetDatum(record->forknum);
+		else
+			nulls[10] = true;
+		if (record->blkno != InvalidBlockNumber)
+			values[11] = Int64GetDatum((int64) record->blkno);
+		else
+			nulls[11] = true;
+		values[12] = Int64GetDatum((int64) record->latency_us);
+		values[13] = CStringGetTextDatum(nm_tag_name(record->response_tag));
+		if (record->response_tag == T_NeonExistsResponse ||
+			record->response_tag == T_NeonNblocksResponse ||
+			record->response_tag == T_NeonDbSizeResponse)
+			values[14] = Int64GetDatum(record->result);
+		else
+			nulls[14] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
@@ -12,7 +12,24 @@
 #ifndef NEON_H
 #define NEON_H
 
+#include "utils/wait_event.h"
+
 extern void pg_init_libpagestore(void);
 extern void pg_init_walproposer(void);
 
+/*
+ * Wait events of the neon extension, in the Extension wait event class.
+ *
+ * PostgreSQL doesn't provide a way for extensions to name their wait events,
+ * so these are all shown as "Extension" in pg_stat_activity. Use
+ * neon_backend_wait_events() to see them by name.
+ */
+#define WAIT_EVENT_NEON_PS_CONNECT		(PG_WAIT_EXTENSION | 1)
+#define WAIT_EVENT_NEON_PS_GETPAGE		(PG_WAIT_EXTENSION | 2)
+#define WAIT_EVENT_NEON_PS_PREFETCH		(PG_WAIT_EXTENSION | 3)
+#define WAIT_EVENT_NEON_PS_RELMETADATA	(PG_WAIT_EXTENSION | 4)
+#define WAIT_EVENT_NEON_BACKPRESSURE	(PG_WAIT_EXTENSION | 5)
+
+extern const char *neon_wait_event_name(uint32 wait_event_info);
+
 #endif							/* NEON_H */
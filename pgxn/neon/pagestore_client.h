@@ -16,11 +16,13 @@
 #include "postgres.h"
 
 #include "access/xlogdefs.h"
+#include "datatype/timestamp.h"
 #include "storage/relfilenode.h"
 #include "storage/block.h"
 #include "storage/smgr.h"
 #include "lib/stringinfo.h"
 #include "libpq/pqformat.h"
+#include "portability/instr_time.h"
 #include "utils/memutils.h"
 
 #include "pg_config.h"
@@ -131,6 +133,7 @@ typedef struct
 extern StringInfoData nm_pack_request(NeonRequest * msg);
 extern NeonResponse * nm_unpack_response(StringInfo s);
 extern char *nm_to_string(NeonMessage * msg);
+extern const char *nm_tag_name(NeonMessageTag tag);
 
 /*
  * API
@@ -146,6 +149,78 @@ typedef struct
 
 extern page_server_api * page_server;
 
+/*
+ * Statistics of requests to the page server, kept in shared memory by
+ * libpagestore.c. Connection attempts are counted as a pseudo request type.
+ */
+typedef enum
+{
+	PS_STAT_EXISTS = 0,
+	PS_STAT_NBLOCKS,
+	PS_STAT_GET_PAGE,
+	PS_STAT_DBSIZE,
+	PS_STAT_CONNECT,
+	PS_STAT_NUM_TYPES
+}			PagestoreStatType;
+
+/*
+ * Latency histogram buckets: bucket 0 counts requests faster than 16 us,
+ * bucket i counts requests below (16 << i) us, and the last bucket counts
+ * everything slower than that.
+ */
+#define PS_STAT_LATENCY_BUCKETS 24
+
+typedef struct
+{
+	uint64		requests;
+	uint64		bytes_sent;
+	uint64		bytes_received;
+	uint64		latency_us;		/* total */
+	uint64		latency_buckets[PS_STAT_LATENCY_BUCKETS];
+}			PagestoreStats;
+
+/*
+ * Page server I/O done by this backend, maintained by pagestore_smgr.c. Like
+ * pgBufferUsage, the counters only grow; take the difference of two
+ * snapshots to measure an operation.
+ */
+typedef struct
+{
+	int64		getpage_requests;	/* pages read from the page server */
+	int64		prefetch_requests;	/* prefetch requests sent */
+	int64		prefetch_hits;	/* pages read from prefetched responses */
+	int64		prefetch_wasted;	/* prefetched pages that were not used */
+	instr_time	wait_time;		/* time spent waiting for the page server */
+}			NeonIOUsage;
+
+extern NeonIOUsage neonIOUsage;
+
+/*
+ * A request and its response in the request trace, see libpagestore.c.
+ * For dbsize requests, only rnode.dbNode is set.
+ */
+typedef struct
+{
+	uint64		seq;			/* position in the trace, starting from 1 */
+	TimestampTz time;			/* when the response was received */
+	int32		pid;
+	NeonMessageTag request_tag;
+	NeonMessageTag response_tag;
+	bool		prefetch;
+	bool		latest;
+	XLogRecPtr	lsn;
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+	uint64		latency_us;
+	int64		result;			/* exists, n_blocks or db_size response */
+}			PagestoreTraceRecord;
+
+extern int	pagestore_get_trace(PagestoreTraceRecord * *records);
+
+extern const char *pagestore_stat_type_name(PagestoreStatType type);
+extern bool pagestore_get_stats(PagestoreStatType type, PagestoreStats * stats);
+
 extern char *page_server_connstring;
 extern char *neon_timeline;
 extern char *neon_tenant;
@@ -191,4 +266,33 @@ extern void set_cached_relsize(RelFileNode rnode, ForkNumber forknum, BlockNumbe
 extern void update_cached_relsize(RelFileNode rnode, ForkNumber forknum, BlockNumber size);
 extern void forget_cached_relsize(RelFileNode rnode, ForkNumber forknum);
 
+/* utils for cache of force-logged VM and FSM pages */
+extern int	wallog_cache_size;
+extern void wallog_cache_init(void);
+extern uint64 wallog_cache_page_hash(char *buffer);
+extern bool wallog_cache_lookup(RelFileNode rnode, ForkNumber forknum, BlockNumber blkno,
+								uint64 hash, XLogRecPtr *lsn);
+extern void wallog_cache_remember(RelFileNode rnode, ForkNumber forknum, BlockNumber blkno,
+								  uint64 hash, XLogRecPtr lsn);
+extern void wallog_cache_forget(RelFileNode rnode, ForkNumber forknum, BlockNumber nblocks);
+extern bool wallog_cache_get_stats(uint64 *entries, uint64 *hits, uint64 *misses,
+								   uint64 *evictions);
+
+/* per-statement statistics of page server reads */
+typedef struct
+{
+	int64		getpage_requests;	/* pages read from the page server */
+	int64		prefetch_hits;	/* of which were prefetched */
+	int64		bytes_received;
+	int64		wait_time_us;	/* time spent waiting for the page server */
+}			StatementStats;
+
+typedef void (*statement_stats_callback) (Oid userid, Oid dbid, uint64 queryid,
+										  StatementStats * stats, void *arg);
+
+extern void statement_stats_init(void);
+extern void statement_stats_record(bool prefetched, instr_time wait_time);
+extern void statement_stats_scan(statement_stats_callback callback, void *arg);
+extern void statement_stats_reset(void);
+
 #endif
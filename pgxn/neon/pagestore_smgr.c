@@ -45,6 +45,8 @@
  */
 #include "postgres.h"
 
+#include <fcntl.h>
+
 #include "access/xact.h"
 #include "access/xlog.h"
 #include "access/xloginsert.h"
@@ -59,12 +61,14 @@
 #include "storage/bufmgr.h"
 #include "storage/relfilenode.h"
 #include "storage/buf_internals.h"
+#include "storage/fd.h"
 #include "storage/md.h"
 #include "fmgr.h"
 #include "miscadmin.h"
 #include "pgstat.h"
 #include "catalog/pg_tablespace_d.h"
 #include "postmaster/autovacuum.h"
+#include "utils/hsearch.h"
 
 #if PG_VERSION_NUM >= 150000
 #include "access/xlogutils.h"
@@ -110,8 +114,42 @@ typedef enum
 	UNLOGGED_BUILD_NOT_PERMANENT
 }			UnloggedBuildPhase;
 
-static SMgrRelation unlogged_build_rel = NULL;
-static UnloggedBuildPhase unlogged_build_phase = UNLOGGED_BUILD_NOT_IN_PROGRESS;
+/*
+ * Unlogged builds in progress in this backend, keyed by relfilenode. There
+ * is usually at most one, but nothing prevents e.g. a function from building
+ * several indexes at once.
+ */
+typedef struct
+{
+	RelFileNode rnode;			/* hash key */
+	SMgrRelation reln;
+	UnloggedBuildPhase phase;
+	SubTransactionId subid;		/* subtransaction that started the build */
+
+	/* Phase 2 state, see unlogged_build_page_is_logged() */
+	XLogRecPtr	phase2_start_lsn;
+
+	/* Read-ahead of the local file in phase 2 */
+	File		readahead_file;
+	BlockNumber readahead_segno;
+	BlockNumber readahead_until;
+} UnloggedBuild;
+
+/*
+ * How far ahead of the current block to read the local file in phase 2 of
+ * an unlogged build. Phase 2 reads the whole relation sequentially, so we
+ * let the kernel do it in large chunks instead of one block at a time.
+ */
+#define UNLOGGED_BUILD_READAHEAD	128		/* 1 MB */
+
+static HTAB *unlogged_builds = NULL;
+
+static UnloggedBuild *lookup_unlogged_build(SMgrRelation reln);
+static void forget_unlogged_builds(SubTransactionId subid);
+static bool unlogged_build_page_is_logged(SMgrRelation reln, ForkNumber forknum,
+										  BlockNumber blkno, char *buffer);
+static void unlogged_build_readahead(SMgrRelation reln, ForkNumber forknum,
+									 BlockNumber blkno);
 
 
 /*
@@ -137,13 +175,51 @@ int			n_prefetch_hits;
 int			n_prefetch_misses;
 XLogRecPtr	prefetch_lsn;
 
+/* Page server I/O done by this backend, see NeonIOUsage */
+NeonIOUsage neonIOUsage;
+
+/*
+ * Wrappers around page_server->receive() and page_server->request() that
+ * account the time spent waiting for the page server.
+ */
+static NeonResponse *
+page_server_receive_timed(void)
+{
+	NeonResponse *resp;
+	instr_time	start;
+	instr_time	end;
+
+	INSTR_TIME_SET_CURRENT(start);
+	resp = page_server->receive();
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(neonIOUsage.wait_time, end, start);
+
+	return resp;
+}
+
+static NeonResponse *
+page_server_request_timed(NeonRequest * req)
+{
+	NeonResponse *resp;
+	instr_time	start;
+	instr_time	end;
+
+	INSTR_TIME_SET_CURRENT(start);
+	resp = page_server->request(req);
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(neonIOUsage.wait_time, end, start);
+
+	return resp;
+}
+
 static void
 consume_prefetch_responses(void)
 {
 	for (int i = n_prefetched_buffers; i < n_prefetch_responses; i++)
 	{
-		NeonResponse *resp = page_server->receive();
+		NeonResponse *resp = page_server_receive_timed();
 
+		neonIOUsage.prefetch_wasted++;
 		pfree(resp);
 	}
 	n_prefetched_buffers = 0;
@@ -154,7 +230,7 @@ static NeonResponse *
 page_server_request(void const *req)
 {
 	consume_prefetch_responses();
-	return page_server->request((NeonRequest *) req);
+	return page_server_request_timed((NeonRequest *) req);
 }
 
 
@@ -326,6 +402,34 @@ nm_unpack_response(StringInfo s)
 	return resp;
 }
 
+/* name of a message type, as shown by nm_to_string() */
+const char *
+nm_tag_name(NeonMessageTag tag)
+{
+	switch (tag)
+	{
+		case T_NeonExistsRequest:
+			return "NeonExistsRequest";
+		case T_NeonNblocksRequest:
+			return "NeonNblocksRequest";
+		case T_NeonGetPageRequest:
+			return "NeonGetPageRequest";
+		case T_NeonDbSizeRequest:
+			return "NeonDbSizeRequest";
+		case T_NeonExistsResponse:
+			return "NeonExistsResponse";
+		case T_NeonNblocksResponse:
+			return "NeonNblocksResponse";
+		case T_NeonGetPageResponse:
+			return "NeonGetPageResponse";
+		case T_NeonErrorResponse:
+			return "NeonErrorResponse";
+		case T_NeonDbSizeResponse:
+			return "NeonDbSizeResponse";
+	}
+	return "unknown";
+}
+
 /* dump to json for debugging / error reporting purposes */
 char *
 nm_to_string(NeonMessage * msg)
@@ -475,6 +579,34 @@ log_newpage_copy(RelFileNode *rnode, ForkNumber forkNum, BlockNumber blkno,
 	return log_newpage(rnode, forkNum, blkno, copied_buffer.data, page_std);
 }
 
+/*
+ * Force-log an evicted VM or FSM page, unless it was already logged with the
+ * same contents. Returns the LSN at which the page server has this version
+ * of the page, and sets *skipped if we didn't need to log it again.
+ */
+static XLogRecPtr
+log_newpage_if_changed(RelFileNode *rnode, ForkNumber forkNum, BlockNumber blkno,
+					   Page page, bool *skipped)
+{
+	uint64		hash;
+	XLogRecPtr	recptr;
+
+	*skipped = false;
+	if (wallog_cache_size == 0)
+		return log_newpage_copy(rnode, forkNum, blkno, page, false);
+
+	hash = wallog_cache_page_hash(page);
+	if (wallog_cache_lookup(*rnode, forkNum, blkno, hash, &recptr))
+	{
+		*skipped = true;
+		return recptr;
+	}
+
+	recptr = log_newpage_copy(rnode, forkNum, blkno, page, false);
+	wallog_cache_remember(*rnode, forkNum, blkno, hash, recptr);
+	return recptr;
+}
+
 /*
  * Is 'buffer' identical to a freshly initialized empty heap page?
  */
@@ -502,22 +634,34 @@ neon_wallog_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, ch
 	 * last chance to log them, otherwise they're lost. That's OK for
 	 * correctness, the non-logged updates are not critical. But we want to
 	 * have a reasonably up-to-date VM and FSM in the page server.
+	 *
+	 * We don't flush the record here. The LSN is remembered as the page's
+	 * last-written LSN below, and neon_get_request_lsn() flushes WAL up to
+	 * that point before the page is requested back from the page server.
+	 * That way a burst of evictions, e.g. during a bulk load or VACUUM,
+	 * shares a single flush instead of waiting for the safekeepers once
+	 * per page.
+	 *
+	 * Pages that are evicted again with the same contents as when they were
+	 * last logged are not logged again, see wallog_cache.c.
 	 */
 	if (forknum == FSM_FORKNUM && !RecoveryInProgress())
 	{
 		/* FSM is never WAL-logged and we don't care. */
 		XLogRecPtr	recptr;
+		bool		skipped;
 
-		recptr = log_newpage_copy(&reln->smgr_rnode.node, forknum, blocknum, buffer, false);
-		XLogFlush(recptr);
+		recptr = log_newpage_if_changed(&reln->smgr_rnode.node, forknum, blocknum, buffer, &skipped);
 		lsn = recptr;
 		ereport(SmgrTrace,
-				(errmsg("FSM page %u of relation %u/%u/%u.%u was force logged. Evicted at lsn=%X/%X",
+				(errmsg("FSM page %u of relation %u/%u/%u.%u was %s. Evicted at lsn=%X/%X",
 						blocknum,
 						reln->smgr_rnode.node.spcNode,
 						reln->smgr_rnode.node.dbNode,
 						reln->smgr_rnode.node.relNode,
-						forknum, LSN_FORMAT_ARGS(lsn))));
+						forknum,
+						skipped ? "already logged" : "force logged",
+						LSN_FORMAT_ARGS(lsn))));
 	}
 	else if (forknum == VISIBILITYMAP_FORKNUM && !RecoveryInProgress())
 	{
@@ -529,18 +673,20 @@ neon_wallog_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, ch
 		 * actively used vm too often.
 		 */
 		XLogRecPtr	recptr;
+		bool		skipped;
 
-		recptr = log_newpage_copy(&reln->smgr_rnode.node, forknum, blocknum, buffer, false);
-		XLogFlush(recptr);
+		recptr = log_newpage_if_changed(&reln->smgr_rnode.node, forknum, blocknum, buffer, &skipped);
 		lsn = recptr;
 
 		ereport(SmgrTrace,
-				(errmsg("Visibilitymap page %u of relation %u/%u/%u.%u was force logged at lsn=%X/%X",
+				(errmsg("Visibilitymap page %u of relation %u/%u/%u.%u was %s at lsn=%X/%X",
 						blocknum,
 						reln->smgr_rnode.node.spcNode,
 						reln->smgr_rnode.node.dbNode,
 						reln->smgr_rnode.node.relNode,
-						forknum, LSN_FORMAT_ARGS(lsn))));
+						forknum,
+						skipped ? "already logged" : "force logged",
+						LSN_FORMAT_ARGS(lsn))));
 	}
 	else if (lsn == InvalidXLogRecPtr)
 	{
@@ -692,7 +838,9 @@ neon_get_request_lsn(bool *latest, RelFileNode rnode, ForkNumber forknum, BlockN
 		 * before all its modifications have been safely flushed. That's the
 		 * "WAL before data" rule. However, such case does exist at index
 		 * building, _bt_blwritepage logs the full page without flushing WAL
-		 * before smgrextend (files are fsynced before build ends).
+		 * before smgrextend (files are fsynced before build ends). Evicted
+		 * FSM and VM pages are also force-logged without a flush, see
+		 * neon_wallog_page().
 		 */
 #if PG_VERSION_NUM >= 150000
 		flushlsn = GetFlushRecPtr(NULL);
@@ -850,6 +998,7 @@ neon_create(SMgrRelation reln, ForkNumber forkNum, bool isRedo)
 	 * the creation WAL record hass been received by the page server.
 	 */
 	set_cached_relsize(reln->smgr_rnode.node, forkNum, 0);
+	wallog_cache_forget(reln->smgr_rnode.node, forkNum, 0);
 
 #ifdef DEBUG_COMPARE_LOCAL
 	if (IS_LOCAL_REL(reln))
@@ -887,9 +1036,66 @@ neon_unlink(RelFileNodeBackend rnode, ForkNumber forkNum, bool isRedo)
 	if (!RelFileNodeBackendIsTemp(rnode))
 	{
 		forget_cached_relsize(rnode.node, forkNum);
+		wallog_cache_forget(rnode.node, forkNum, 0);
 	}
 }
 
+/*
+ * Check that the cluster size limit has not been exceeded, before extending
+ * a permanent relation.
+ *
+ * Temporary and unlogged relations are not included in the cluster size
+ * measured by the page server, so ignore those. Autovacuum processes are
+ * also exempt.
+ */
+static void
+neon_check_cluster_size(SMgrRelation reln)
+{
+	if (max_cluster_size > 0 &&
+		reln->smgr_relpersistence == RELPERSISTENCE_PERMANENT &&
+		!IsAutoVacuumWorkerProcess())
+	{
+		uint64		current_size = GetZenithCurrentClusterSize();
+
+		if (current_size >= ((uint64) max_cluster_size) * 1024 * 1024)
+			ereport(ERROR,
+					(errcode(ERRCODE_DISK_FULL),
+					 errmsg("could not extend file because cluster size limit (%d MB) has been exceeded",
+							max_cluster_size),
+					 errhint("This limit is defined by neon.max_cluster_size GUC")));
+	}
+}
+
+/*
+ * Extend a permanent relation with an all-zeros page at 'blkno'.
+ *
+ * There's nothing to WAL-log for an all-zeros page. An smgr_write() call
+ * will come for the buffer later, after it has been initialized with the
+ * real page contents, and it is eventually evicted from the buffer cache. We
+ * only need to remember the new size, and a valid LSN for the new block and
+ * the relation metadata.
+ */
+static void
+neon_extend_zeroes(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno)
+{
+	XLogRecPtr	lsn;
+
+	neon_check_cluster_size(reln);
+
+	set_cached_relsize(reln->smgr_rnode.node, forkNum, blkno + 1);
+
+	lsn = GetXLogInsertRecPtr();
+	elog(SmgrTrace, "smgrextend called for %u/%u/%u.%u blk %u with a zero page, LSN: %X/%08X",
+		 reln->smgr_rnode.node.spcNode,
+		 reln->smgr_rnode.node.dbNode,
+		 reln->smgr_rnode.node.relNode,
+		 forkNum, blkno,
+		 (uint32) (lsn >> 32), (uint32) lsn);
+
+	SetLastWrittenLSNForBlock(lsn, reln->smgr_rnode.node, forkNum, blkno);
+	SetLastWrittenLSNForRelation(lsn, reln->smgr_rnode.node, forkNum);
+}
+
 /*
  *	neon_extend() -- Add a block to the specified relation.
  *
@@ -922,27 +1128,23 @@ neon_extend(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno,
 			elog(ERROR, "unknown relpersistence '%c'", reln->smgr_relpersistence);
 	}
 
+#ifdef DEBUG_COMPARE_LOCAL
+	if (IS_LOCAL_REL(reln))
+		mdextend(reln, forkNum, blkno, buffer, skipFsync);
+#endif
+
 	/*
-	 * Check that the cluster size limit has not been exceeded.
-	 *
-	 * Temporary and unlogged relations are not included in the cluster size
-	 * measured by the page server, so ignore those. Autovacuum processes are
-	 * also exempt.
+	 * smgr_extend is usually called with an all-zeroes page, e.g. when the
+	 * heap is extended by INSERT or COPY. Take the fast path for that.
 	 */
-	if (max_cluster_size > 0 &&
-		reln->smgr_relpersistence == RELPERSISTENCE_PERMANENT &&
-		!IsAutoVacuumWorkerProcess())
+	if (PageIsNew(buffer))
 	{
-		uint64		current_size = GetZenithCurrentClusterSize();
-
-		if (current_size >= ((uint64) max_cluster_size) * 1024 * 1024)
-			ereport(ERROR,
-					(errcode(ERRCODE_DISK_FULL),
-					 errmsg("could not extend file because cluster size limit (%d MB) has been exceeded",
-							max_cluster_size),
-					 errhint("This limit is defined by neon.max_cluster_size GUC")));
+		neon_extend_zeroes(reln, forkNum, blkno);
+		return;
 	}
 
+	neon_check_cluster_size(reln);
+
 	neon_wallog_page(reln, forkNum, blkno, buffer);
 	set_cached_relsize(reln->smgr_rnode.node, forkNum, blkno + 1);
 
@@ -954,15 +1156,10 @@ neon_extend(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno,
 		 forkNum, blkno,
 		 (uint32) (lsn >> 32), (uint32) lsn);
 
-#ifdef DEBUG_COMPARE_LOCAL
-	if (IS_LOCAL_REL(reln))
-		mdextend(reln, forkNum, blkno, buffer, skipFsync);
-#endif
 	/*
-	 * smgr_extend is often called with an all-zeroes page, so lsn==InvalidXLogRecPtr.
-	 * An smgr_write() call will come for the buffer later, after it has been initialized
-	 * with the real page contents, and it is eventually evicted from the buffer cache.
-	 * But we need a valid LSN to the relation metadata update now.
+	 * A page that is not all-zeros but has no LSN is an empty heap page, see
+	 * neon_wallog_page(). We still need a valid LSN for the relation metadata
+	 * update.
 	 */
 	if (lsn == InvalidXLogRecPtr)
 	{
@@ -1095,6 +1292,8 @@ neon_read_at_lsn(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 {
 	NeonResponse *resp;
 	int			i;
+	instr_time	wait_start = neonIOUsage.wait_time;
+	instr_time	wait_time;
 
 	/*
 	 * Try to find prefetched page. It is assumed that pages will be requested
@@ -1104,7 +1303,7 @@ neon_read_at_lsn(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 	 */
 	for (i = n_prefetched_buffers; i < n_prefetch_responses; i++)
 	{
-		resp = page_server->receive();
+		resp = page_server_receive_timed();
 		if (resp->tag == T_NeonGetPageResponse &&
 			RelFileNodeEquals(prefetch_responses[i].rnode, rnode) &&
 			prefetch_responses[i].forkNum == forkNum &&
@@ -1126,16 +1325,24 @@ neon_read_at_lsn(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 				n_prefetched_buffers = i + 1;
 				n_prefetch_hits += 1;
 				n_prefetch_requests = 0;
+				neonIOUsage.prefetch_hits++;
 				memcpy(buffer, page, BLCKSZ);
 				pfree(resp);
+
+				wait_time = neonIOUsage.wait_time;
+				INSTR_TIME_SUBTRACT(wait_time, wait_start);
+				statement_stats_record(true, wait_time);
 				return;
 			}
 		}
+		neonIOUsage.prefetch_wasted++;
 		pfree(resp);
 	}
 	n_prefetched_buffers = 0;
 	n_prefetch_responses = 0;
 	n_prefetch_misses += 1;
+	neonIOUsage.getpage_requests++;
+	neonIOUsage.prefetch_requests += n_prefetch_requests;
 	{
 		NeonGetPageRequest request = {
 			.req.tag = T_NeonGetPageRequest,
@@ -1162,17 +1369,21 @@ neon_read_at_lsn(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 			n_prefetch_responses = n_prefetch_requests;
 			n_prefetch_requests = 0;
 			prefetch_lsn = request_lsn;
-			resp = page_server->receive();
+			resp = page_server_receive_timed();
 		}
 		else
 		{
-			resp = page_server->request((NeonRequest *) & request);
+			resp = page_server_request_timed((NeonRequest *) & request);
 		}
 	}
 	switch (resp->tag)
 	{
 		case T_NeonGetPageResponse:
 			memcpy(buffer, ((NeonGetPageResponse *) resp)->page, BLCKSZ);
+
+			wait_time = neonIOUsage.wait_time;
+			INSTR_TIME_SUBTRACT(wait_time, wait_start);
+			statement_stats_record(false, wait_time);
 			break;
 
 		case T_NeonErrorResponse:
@@ -1216,6 +1427,7 @@ neon_read(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno,
 
 		case RELPERSISTENCE_TEMP:
 		case RELPERSISTENCE_UNLOGGED:
+			unlogged_build_readahead(reln, forkNum, blkno);
 			mdread(reln, forkNum, blkno, buffer);
 			return;
 
@@ -1367,6 +1579,8 @@ neon_write(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 
 		case RELPERSISTENCE_TEMP:
 		case RELPERSISTENCE_UNLOGGED:
+			if (unlogged_build_page_is_logged(reln, forknum, blocknum, buffer))
+				return;
 			mdwrite(reln, forknum, blocknum, buffer, skipFsync);
 			return;
 
@@ -1557,6 +1771,7 @@ neon_truncate(SMgrRelation reln, ForkNumber forknum, BlockNumber nblocks)
 	}
 
 	set_cached_relsize(reln->smgr_rnode.node, forknum, nblocks);
+	wallog_cache_forget(reln->smgr_rnode.node, forknum, nblocks);
 
 	/*
 	 * Truncating a relation drops all its buffers from the buffer cache
@@ -1632,6 +1847,152 @@ neon_immedsync(SMgrRelation reln, ForkNumber forknum)
 #endif
 }
 
+/*
+ * Find the unlogged build in progress on a rel, if any.
+ */
+static UnloggedBuild *
+lookup_unlogged_build(SMgrRelation reln)
+{
+	if (unlogged_builds == NULL || hash_get_num_entries(unlogged_builds) == 0)
+		return NULL;
+
+	return hash_search(unlogged_builds, &reln->smgr_rnode.node, HASH_FIND, NULL);
+}
+
+/*
+ * In phase 2 of an unlogged build, the index AM WAL-logs the relation page
+ * by page, reading it sequentially from the local file. A page that has
+ * already been logged in phase 2 is now in the page server, so if it's
+ * evicted, there's no need to write it back to the local file, which is
+ * about to be removed anyway. That saves writing the whole index to local
+ * disk a second time.
+ *
+ * Returns true if the page was logged and the write can be skipped.
+ */
+static bool
+unlogged_build_page_is_logged(SMgrRelation reln, ForkNumber forknum,
+							  BlockNumber blkno, char *buffer)
+{
+	UnloggedBuild *build;
+	XLogRecPtr	lsn;
+
+	if (forknum != MAIN_FORKNUM)
+		return false;
+
+	build = lookup_unlogged_build(reln);
+	if (build == NULL || build->phase != UNLOGGED_BUILD_PHASE_2)
+		return false;
+
+	/*
+	 * Pages built in phase 1 carry no LSN, or a fake one like GistBuildLSN.
+	 * Anything at or above the insert position at the start of phase 2 was
+	 * set by the record that logged the page.
+	 */
+	lsn = PageGetLSN(buffer);
+	if (lsn < build->phase2_start_lsn)
+		return false;
+
+	ereport(SmgrTrace,
+			(errmsg("page %u of relation %u/%u/%u under unlogged build was logged at lsn=%X/%X, skipping local write",
+					blkno,
+					reln->smgr_rnode.node.spcNode,
+					reln->smgr_rnode.node.dbNode,
+					reln->smgr_rnode.node.relNode,
+					LSN_FORMAT_ARGS(lsn))));
+
+	SetLastWrittenLSNForBlock(lsn, reln->smgr_rnode.node, forknum, blkno);
+	return true;
+}
+
+/*
+ * Read ahead the local file of a relation in phase 2 of an unlogged build.
+ *
+ * md.c only knows how to prefetch one block at a time, so we keep our own
+ * handle on the current segment and ask the kernel for the next
+ * UNLOGGED_BUILD_READAHEAD blocks at once, when the previous chunk is half
+ * consumed.
+ */
+static void
+unlogged_build_readahead(SMgrRelation reln, ForkNumber forknum, BlockNumber blkno)
+{
+	UnloggedBuild *build;
+	BlockNumber start;
+	BlockNumber end;
+	BlockNumber segno;
+
+	if (forknum != MAIN_FORKNUM)
+		return;
+
+	build = lookup_unlogged_build(reln);
+	if (build == NULL || build->phase != UNLOGGED_BUILD_PHASE_2)
+		return;
+
+	if (blkno + UNLOGGED_BUILD_READAHEAD / 2 < build->readahead_until)
+		return;
+
+	start = Max(blkno, build->readahead_until);
+	segno = start / ((BlockNumber) RELSEG_SIZE);
+	end = Min(start + UNLOGGED_BUILD_READAHEAD, (segno + 1) * ((BlockNumber) RELSEG_SIZE));
+	build->readahead_until = end;
+
+	if (build->readahead_file < 0 || build->readahead_segno != segno)
+	{
+		char	   *path;
+
+		if (build->readahead_file >= 0)
+			FileClose(build->readahead_file);
+
+		path = relpathperm(reln->smgr_rnode.node, forknum);
+		if (segno > 0)
+		{
+			char	   *segpath = psprintf("%s.%u", path, segno);
+
+			pfree(path);
+			path = segpath;
+		}
+		build->readahead_file = PathNameOpenFile(path, O_RDONLY | PG_BINARY);
+		build->readahead_segno = segno;
+		pfree(path);
+
+		/* Read-ahead is just an optimization, mdread() will complain */
+		if (build->readahead_file < 0)
+			return;
+	}
+
+	(void) FilePrefetch(build->readahead_file,
+						(off_t) (start % ((BlockNumber) RELSEG_SIZE)) * BLCKSZ,
+						(end - start) * BLCKSZ,
+						WAIT_EVENT_DATA_FILE_PREFETCH);
+}
+
+/*
+ * Forget about the unlogged builds started in the given subtransaction, or
+ * all of them if subid is InvalidSubTransactionId.
+ *
+ * The local files are unlinked by smgrDoPendingDeletes(), as the relations
+ * were created in the aborted (sub)transaction.
+ */
+static void
+forget_unlogged_builds(SubTransactionId subid)
+{
+	HASH_SEQ_STATUS status;
+	UnloggedBuild *build;
+
+	if (unlogged_builds == NULL)
+		return;
+
+	hash_seq_init(&status, unlogged_builds);
+	while ((build = hash_seq_search(&status)) != NULL)
+	{
+		if (subid == InvalidSubTransactionId || build->subid == subid)
+		{
+			if (build->readahead_file >= 0)
+				FileClose(build->readahead_file);
+			hash_search(unlogged_builds, &build->rnode, HASH_REMOVE, NULL);
+		}
+	}
+}
+
 /*
  * neon_start_unlogged_build() -- Starting build operation on a rel.
  *
@@ -1640,17 +2001,38 @@ neon_immedsync(SMgrRelation reln, ForkNumber forknum)
  * and WAL-logging the whole relation after it's done. Neon relies on the
  * WAL to reconstruct pages, so we cannot use the page server in the
  * first phase when the changes are not logged.
+ *
+ * Several builds can be in progress at the same time, on different rels.
  */
 static void
 neon_start_unlogged_build(SMgrRelation reln)
 {
-	/*
-	 * Currently, there can be only one unlogged relation build operation in
-	 * progress at a time. That's enough for the current usage.
-	 */
-	if (unlogged_build_phase != UNLOGGED_BUILD_NOT_IN_PROGRESS)
-		elog(ERROR, "unlogged relation build is already in progress");
-	Assert(unlogged_build_rel == NULL);
+	UnloggedBuild *build;
+	bool		found;
+
+	if (unlogged_builds == NULL)
+	{
+		HASHCTL		info;
+
+		info.keysize = sizeof(RelFileNode);
+		info.entrysize = sizeof(UnloggedBuild);
+		unlogged_builds = hash_create("neon unlogged builds", 8,
+									  &info, HASH_ELEM | HASH_BLOBS);
+	}
+
+	build = hash_search(unlogged_builds, &reln->smgr_rnode.node, HASH_ENTER, &found);
+	if (found)
+		elog(ERROR, "unlogged build of relation %u/%u/%u is already in progress",
+			 reln->smgr_rnode.node.spcNode,
+			 reln->smgr_rnode.node.dbNode,
+			 reln->smgr_rnode.node.relNode);
+	build->reln = reln;
+	build->phase = UNLOGGED_BUILD_NOT_IN_PROGRESS;
+	build->subid = GetCurrentSubTransactionId();
+	build->phase2_start_lsn = InvalidXLogRecPtr;
+	build->readahead_file = -1;
+	build->readahead_segno = 0;
+	build->readahead_until = 0;
 
 	ereport(SmgrTrace,
 			(errmsg("starting unlogged build of relation %u/%u/%u",
@@ -1661,6 +2043,7 @@ neon_start_unlogged_build(SMgrRelation reln)
 	switch (reln->smgr_relpersistence)
 	{
 		case 0:
+			hash_search(unlogged_builds, &reln->smgr_rnode.node, HASH_REMOVE, NULL);
 			elog(ERROR, "cannot call smgr_start_unlogged_build() on rel with unknown persistence");
 			break;
 
@@ -1669,19 +2052,21 @@ neon_start_unlogged_build(SMgrRelation reln)
 
 		case RELPERSISTENCE_TEMP:
 		case RELPERSISTENCE_UNLOGGED:
-			unlogged_build_rel = reln;
-			unlogged_build_phase = UNLOGGED_BUILD_NOT_PERMANENT;
+			build->phase = UNLOGGED_BUILD_NOT_PERMANENT;
 			return;
 
 		default:
+			hash_search(unlogged_builds, &reln->smgr_rnode.node, HASH_REMOVE, NULL);
 			elog(ERROR, "unknown relpersistence '%c'", reln->smgr_relpersistence);
 	}
 
 	if (smgrnblocks(reln, MAIN_FORKNUM) != 0)
+	{
+		hash_search(unlogged_builds, &reln->smgr_rnode.node, HASH_REMOVE, NULL);
 		elog(ERROR, "cannot perform unlogged index build, index is not empty ");
+	}
 
-	unlogged_build_rel = reln;
-	unlogged_build_phase = UNLOGGED_BUILD_PHASE_1;
+	build->phase = UNLOGGED_BUILD_PHASE_1;
 
 	/* Make the relation look like it's unlogged */
 	reln->smgr_relpersistence = RELPERSISTENCE_UNLOGGED;
@@ -1702,7 +2087,14 @@ neon_start_unlogged_build(SMgrRelation reln)
 static void
 neon_finish_unlogged_build_phase_1(SMgrRelation reln)
 {
-	Assert(unlogged_build_rel == reln);
+	UnloggedBuild *build = lookup_unlogged_build(reln);
+
+	if (build == NULL)
+		elog(ERROR, "unlogged build of relation %u/%u/%u is not in progress",
+			 reln->smgr_rnode.node.spcNode,
+			 reln->smgr_rnode.node.dbNode,
+			 reln->smgr_rnode.node.relNode);
+	Assert(build->reln == reln);
 
 	ereport(SmgrTrace,
 			(errmsg("finishing phase 1 of unlogged build of relation %u/%u/%u",
@@ -1710,13 +2102,14 @@ neon_finish_unlogged_build_phase_1(SMgrRelation reln)
 					reln->smgr_rnode.node.dbNode,
 					reln->smgr_rnode.node.relNode)));
 
-	if (unlogged_build_phase == UNLOGGED_BUILD_NOT_PERMANENT)
+	if (build->phase == UNLOGGED_BUILD_NOT_PERMANENT)
 		return;
 
-	Assert(unlogged_build_phase == UNLOGGED_BUILD_PHASE_1);
+	Assert(build->phase == UNLOGGED_BUILD_PHASE_1);
 	Assert(reln->smgr_relpersistence == RELPERSISTENCE_UNLOGGED);
 
-	unlogged_build_phase = UNLOGGED_BUILD_PHASE_2;
+	build->phase = UNLOGGED_BUILD_PHASE_2;
+	build->phase2_start_lsn = GetXLogInsertRecPtr();
 }
 
 /*
@@ -1731,7 +2124,14 @@ neon_finish_unlogged_build_phase_1(SMgrRelation reln)
 static void
 neon_end_unlogged_build(SMgrRelation reln)
 {
-	Assert(unlogged_build_rel == reln);
+	UnloggedBuild *build = lookup_unlogged_build(reln);
+
+	if (build == NULL)
+		elog(ERROR, "unlogged build of relation %u/%u/%u is not in progress",
+			 reln->smgr_rnode.node.spcNode,
+			 reln->smgr_rnode.node.dbNode,
+			 reln->smgr_rnode.node.relNode);
+	Assert(build->reln == reln);
 
 	ereport(SmgrTrace,
 			(errmsg("ending unlogged build of relation %u/%u/%u",
@@ -1739,16 +2139,22 @@ neon_end_unlogged_build(SMgrRelation reln)
 					reln->smgr_rnode.node.dbNode,
 					reln->smgr_rnode.node.relNode)));
 
-	if (unlogged_build_phase != UNLOGGED_BUILD_NOT_PERMANENT)
+	if (build->phase != UNLOGGED_BUILD_NOT_PERMANENT)
 	{
 		RelFileNodeBackend rnode;
 
-		Assert(unlogged_build_phase == UNLOGGED_BUILD_PHASE_2);
+		Assert(build->phase == UNLOGGED_BUILD_PHASE_2);
 		Assert(reln->smgr_relpersistence == RELPERSISTENCE_UNLOGGED);
 
 		/* Make the relation look permanent again */
 		reln->smgr_relpersistence = RELPERSISTENCE_PERMANENT;
 
+		if (build->readahead_file >= 0)
+		{
+			FileClose(build->readahead_file);
+			build->readahead_file = -1;
+		}
+
 		/* Remove local copy */
 		rnode = reln->smgr_rnode;
 		for (int forknum = 0; forknum <= MAX_FORKNUM; forknum++)
@@ -1766,8 +2172,7 @@ neon_end_unlogged_build(SMgrRelation reln)
 		}
 	}
 
-	unlogged_build_rel = NULL;
-	unlogged_build_phase = UNLOGGED_BUILD_NOT_IN_PROGRESS;
+	hash_search(unlogged_builds, &reln->smgr_rnode.node, HASH_REMOVE, NULL);
 }
 
 static void
@@ -1779,11 +2184,10 @@ AtEOXact_neon(XactEvent event, void *arg)
 		case XACT_EVENT_PARALLEL_ABORT:
 
 			/*
-			 * Forget about any build we might have had in progress. The local
-			 * file will be unlinked by smgrDoPendingDeletes()
+			 * Forget about any builds we might have had in progress. The local
+			 * files will be unlinked by smgrDoPendingDeletes()
 			 */
-			unlogged_build_rel = NULL;
-			unlogged_build_phase = UNLOGGED_BUILD_NOT_IN_PROGRESS;
+			forget_unlogged_builds(InvalidSubTransactionId);
 			break;
 
 		case XACT_EVENT_COMMIT:
@@ -1792,10 +2196,9 @@ AtEOXact_neon(XactEvent event, void *arg)
 		case XACT_EVENT_PRE_COMMIT:
 		case XACT_EVENT_PARALLEL_PRE_COMMIT:
 		case XACT_EVENT_PRE_PREPARE:
-			if (unlogged_build_phase != UNLOGGED_BUILD_NOT_IN_PROGRESS)
+			if (unlogged_builds != NULL && hash_get_num_entries(unlogged_builds) > 0)
 			{
-				unlogged_build_rel = NULL;
-				unlogged_build_phase = UNLOGGED_BUILD_NOT_IN_PROGRESS;
+				forget_unlogged_builds(InvalidSubTransactionId);
 				ereport(ERROR,
 						(errcode(ERRCODE_INTERNAL_ERROR),
 						 (errmsg("unlogged index build was not properly finished"))));
@@ -1804,6 +2207,39 @@ AtEOXact_neon(XactEvent event, void *arg)
 	}
 }
 
+static void
+AtEOSubXact_neon(SubXactEvent event, SubTransactionId mySubid,
+				 SubTransactionId parentSubid, void *arg)
+{
+	switch (event)
+	{
+		case SUBXACT_EVENT_ABORT_SUB:
+			/* Forget about the builds that were aborted with the subtransaction */
+			forget_unlogged_builds(mySubid);
+			break;
+
+		case SUBXACT_EVENT_COMMIT_SUB:
+			/* Builds started in the subtransaction now belong to the parent */
+			if (unlogged_builds != NULL)
+			{
+				HASH_SEQ_STATUS status;
+				UnloggedBuild *build;
+
+				hash_seq_init(&status, unlogged_builds);
+				while ((build = hash_seq_search(&status)) != NULL)
+				{
+					if (build->subid == mySubid)
+						build->subid = parentSubid;
+				}
+			}
+			break;
+
+		case SUBXACT_EVENT_START_SUB:
+		case SUBXACT_EVENT_PRE_COMMIT_SUB:
+			break;
+	}
+}
+
 static const struct f_smgr neon_smgr =
 {
 	.smgr_init = neon_init,
@@ -1843,6 +2279,7 @@ void
 smgr_init_neon(void)
 {
 	RegisterXactCallback(AtEOXact_neon, NULL);
+	RegisterSubXactCallback(AtEOSubXact_neon, NULL);
 
 	smgr_init_standard();
 	neon_init();
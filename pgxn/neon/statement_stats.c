@@ -0,0 +1,372 @@
+/*-------------------------------------------------------------------------
+ *
+ * statement_stats.c
+ *      Per-statement statistics of page server reads.
+ *
+ * pg_stat_statements can tell how many blocks a statement read into shared
+ * buffers, but not how many of them had to be fetched from the page server,
+ * which is what drives the load on the page server and the latency of the
+ * statement. This keeps a shared hash table, keyed by user, database and
+ * query ID like pg_stat_statements, with the number of GetPage requests
+ * made by each statement, the bytes received and the time spent waiting for
+ * the page server. It is exposed by the neon_stat_statements view.
+ *
+ * neon_read_at_lsn() accounts every page read from the page server in
+ * backend-local counters, which are added to the shared table at the end of
+ * each statement, at the end of the transaction, or when reads start being
+ * made for a different statement, so that the reads don't contend on the
+ * shared table.
+ *
+ * Query IDs are computed by the core; on PostgreSQL 15 we ask for them with
+ * EnableQueryId(), on 14 compute_query_id must be enabled. Reads made while
+ * no query ID is set are not tracked. The table holds at most
+ * neon.stat_statements_max entries. When it's full, the least used entries
+ * are evicted to make room, like pg_stat_statements does: each entry has a
+ * usage count, incremented every time its counters are updated and decayed
+ * on every eviction.
+ *
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ *
+ * IDENTIFICATION
+ *	  contrib/neon/statement_stats.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pagestore_client.h"
+#include "access/xact.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/backend_status.h"
+#include "utils/dynahash.h"
+#include "utils/guc.h"
+
+#if PG_VERSION_NUM >= 150000
+#include "utils/queryjumble.h"
+#endif
+
+typedef struct
+{
+	Oid			userid;
+	Oid			dbid;
+	uint64		queryid;
+} StatementStatsKey;
+
+typedef struct
+{
+	StatementStatsKey key;
+	slock_t		mutex;			/* protects the counters and usage */
+	StatementStats counters;
+	double		usage;
+} StatementStatsEntry;
+
+static HTAB *statement_stats_hash;
+static LWLockId statement_stats_lock;
+static int	statement_stats_max;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static void statement_stats_shmem_request(void);
+#endif
+
+/* reads of the current statement not added to the shared table yet */
+static StatementStatsKey pending_key;
+static StatementStats pending_counters;
+static bool pending = false;
+
+#define DEFAULT_STATEMENT_STATS_MAX 5000
+
+/* as in pg_stat_statements */
+#define USAGE_DECREASE_FACTOR	(0.99)	/* decreased every eviction */
+#define USAGE_DEALLOC_PERCENT	5	/* free this % of entries at once */
+
+static void
+statement_stats_shmem_startup(void)
+{
+	static HASHCTL info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	statement_stats_lock = (LWLockId) GetNamedLWLockTranche("neon_statement_stats");
+	info.keysize = sizeof(StatementStatsKey);
+	info.entrysize = sizeof(StatementStatsEntry);
+	statement_stats_hash = ShmemInitHash("neon_statement_stats",
+										 statement_stats_max, statement_stats_max,
+										 &info,
+										 HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * qsort comparator for sorting into increasing usage order
+ */
+static int
+entry_cmp(const void *lhs, const void *rhs)
+{
+	double		l_usage = (*(StatementStatsEntry * const *) lhs)->usage;
+	double		r_usage = (*(StatementStatsEntry * const *) rhs)->usage;
+
+	if (l_usage < r_usage)
+		return -1;
+	else if (l_usage > r_usage)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Evict the least used entries, and decay the usage of the rest.
+ *
+ * Caller must hold an exclusive lock on statement_stats_lock.
+ */
+static void
+entry_dealloc(void)
+{
+	HASH_SEQ_STATUS status;
+	StatementStatsEntry **entries;
+	StatementStatsEntry *entry;
+	int			nvictims;
+	int			i = 0;
+
+	entries = palloc(hash_get_num_entries(statement_stats_hash) * sizeof(StatementStatsEntry *));
+
+	hash_seq_init(&status, statement_stats_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		entries[i++] = entry;
+		entry->usage *= USAGE_DECREASE_FACTOR;
+	}
+
+	qsort(entries, i, sizeof(StatementStatsEntry *), entry_cmp);
+
+	nvictims = Max(10, i * USAGE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (int j = 0; j < nvictims; j++)
+		hash_search(statement_stats_hash, &entries[j]->key, HASH_REMOVE, NULL);
+
+	pfree(entries);
+}
+
+/*
+ * Add the pending reads to the shared table.
+ */
+static void
+statement_stats_flush(void)
+{
+	StatementStatsEntry *entry;
+
+	if (!pending)
+		return;
+	pending = false;
+
+	LWLockAcquire(statement_stats_lock, LW_SHARED);
+	entry = hash_search(statement_stats_hash, &pending_key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		/* Need exclusive lock to add a new entry */
+		LWLockRelease(statement_stats_lock);
+		LWLockAcquire(statement_stats_lock, LW_EXCLUSIVE);
+
+		/* Make room if the table is full */
+		if (hash_get_num_entries(statement_stats_hash) >= statement_stats_max)
+			entry_dealloc();
+
+		entry = hash_search(statement_stats_hash, &pending_key, HASH_ENTER, &found);
+		if (!found)
+		{
+			SpinLockInit(&entry->mutex);
+			memset(&entry->counters, 0, sizeof(entry->counters));
+			entry->usage = 0;
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->counters.getpage_requests += pending_counters.getpage_requests;
+	entry->counters.prefetch_hits += pending_counters.prefetch_hits;
+	entry->counters.bytes_received += pending_counters.bytes_received;
+	entry->counters.wait_time_us += pending_counters.wait_time_us;
+	entry->usage += 1;
+	SpinLockRelease(&entry->mutex);
+	LWLockRelease(statement_stats_lock);
+}
+
+/*
+ * Account a page read from the page server to the current statement.
+ *
+ * 'prefetched' is true if the page was received in response to an earlier
+ * prefetch request, 'wait_time' is the time spent waiting for it.
+ */
+void
+statement_stats_record(bool prefetched, instr_time wait_time)
+{
+	StatementStatsKey key;
+
+	if (statement_stats_max == 0)
+		return;
+
+	key.queryid = pgstat_get_my_query_id();
+	if (key.queryid == UINT64CONST(0))
+		return;
+	key.userid = GetUserId();
+	key.dbid = MyDatabaseId;
+
+	/* Reads of another statement, e.g. one called from a function */
+	if (pending && memcmp(&key, &pending_key, sizeof(key)) != 0)
+		statement_stats_flush();
+
+	if (!pending)
+	{
+		pending_key = key;
+		memset(&pending_counters, 0, sizeof(pending_counters));
+		pending = true;
+	}
+
+	pending_counters.getpage_requests++;
+	if (prefetched)
+		pending_counters.prefetch_hits++;
+	pending_counters.bytes_received += BLCKSZ;
+	pending_counters.wait_time_us += INSTR_TIME_GET_MICROSEC(wait_time);
+}
+
+static void
+statement_stats_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (prev_ExecutorEnd_hook)
+		prev_ExecutorEnd_hook(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+
+	statement_stats_flush();
+}
+
+/*
+ * Reads made by utility statements, or by statements that failed, are added
+ * at the end of the transaction.
+ */
+static void
+statement_stats_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			statement_stats_flush();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Call 'callback' for every tracked statement.
+ */
+void
+statement_stats_scan(statement_stats_callback callback, void *arg)
+{
+	HASH_SEQ_STATUS status;
+	StatementStatsEntry *entry;
+
+	if (statement_stats_max == 0)
+		return;
+
+	LWLockAcquire(statement_stats_lock, LW_SHARED);
+	hash_seq_init(&status, statement_stats_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		StatementStats counters;
+
+		SpinLockAcquire(&entry->mutex);
+		counters = entry->counters;
+		SpinLockRelease(&entry->mutex);
+
+		callback(entry->key.userid, entry->key.dbid, entry->key.queryid,
+				 &counters, arg);
+	}
+	LWLockRelease(statement_stats_lock);
+}
+
+/*
+ * Remove all entries.
+ */
+void
+statement_stats_reset(void)
+{
+	HASH_SEQ_STATUS status;
+	StatementStatsEntry *entry;
+
+	if (statement_stats_max == 0)
+		return;
+
+	LWLockAcquire(statement_stats_lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, statement_stats_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		hash_search(statement_stats_hash, &entry->key, HASH_REMOVE, NULL);
+	LWLockRelease(statement_stats_lock);
+}
+
+void
+statement_stats_init(void)
+{
+	DefineCustomIntVariable("neon.stat_statements_max",
+							"Sets the maximum number of statements tracked by neon_stat_statements",
+							"Zero disables the tracking.",
+							&statement_stats_max,
+							DEFAULT_STATEMENT_STATS_MAX,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	if (statement_stats_max > 0)
+	{
+#if PG_VERSION_NUM >= 150000
+		EnableQueryId();
+
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = statement_stats_shmem_request;
+#else
+		RequestAddinShmemSpace(hash_estimate_size(statement_stats_max, sizeof(StatementStatsEntry)));
+		RequestNamedLWLockTranche("neon_statement_stats", 1);
+#endif
+
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = statement_stats_shmem_startup;
+
+		prev_ExecutorEnd_hook = ExecutorEnd_hook;
+		ExecutorEnd_hook = statement_stats_ExecutorEnd;
+		RegisterXactCallback(statement_stats_xact_callback, NULL);
+	}
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * shmem_request hook: request additional shared resources.  We'll allocate or
+ * attach to the shared resources in statement_stats_shmem_startup().
+ */
+static void
+statement_stats_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(hash_estimate_size(statement_stats_max, sizeof(StatementStatsEntry)));
+	RequestNamedLWLockTranche("neon_statement_stats", 1);
+}
+#endif
@@ -0,0 +1,387 @@
+/*-------------------------------------------------------------------------
+ *
+ * wallog_cache.c
+ *      Cache of VM and FSM pages that were force-logged at eviction.
+ *
+ * When a visibility map or free space map page is evicted from the buffer
+ * cache, neon_wallog_page() WAL-logs a full image of it, because changes to
+ * these pages are not (always) WAL-logged when they are made. Hot VM pages
+ * of big tables can be evicted and read back many times without changing,
+ * and logging the same image over and over again just inflates the WAL.
+ *
+ * To avoid that, we remember a hash of the contents of each force-logged
+ * page, along with the LSN of the record that logged it. If the page is
+ * evicted again with the same contents, the page server already has it at
+ * that LSN and we can skip logging it.
+ *
+ * When the cache is full, a page is evicted with the second-chance (clock)
+ * algorithm, so that lookups, which are made for every VM and FSM page
+ * eviction, can run concurrently under a shared lock: a hit only sets the
+ * referenced flag of the page, and eviction gives referenced pages another
+ * round before evicting them. The cached pages of each relation fork are
+ * also linked together, so that they can be forgotten without scanning the
+ * whole cache when the relation is truncated or dropped.
+ *
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ *
+ * IDENTIFICATION
+ *	  contrib/neon/wallog_cache.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "pagestore_client.h"
+#include "common/hashfn.h"
+#include "lib/ilist.h"
+#include "port/atomics.h"
+#include "storage/relfilenode.h"
+#include "storage/smgr.h"
+#include "storage/lwlock.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+#include "utils/dynahash.h"
+#include "utils/guc.h"
+
+#if PG_VERSION_NUM >= 150000
+#include "miscadmin.h"
+#endif
+
+typedef struct
+{
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+} WallogTag;
+
+typedef struct
+{
+	WallogTag	tag;
+	uint64		hash;			/* hash of the page contents */
+	XLogRecPtr	lsn;			/* LSN of the record that logged them */
+	pg_atomic_uint32 referenced;	/* looked up since the last clock pass */
+	dlist_node	lru_node;		/* in WallogCacheCtl->lru */
+	dlist_node	rel_node;		/* in WallogRelEntry->pages */
+} WallogEntry;
+
+typedef struct
+{
+	RelFileNode rnode;
+	ForkNumber	forknum;
+} WallogRelTag;
+
+typedef struct
+{
+	WallogRelTag tag;
+	dlist_head	pages;			/* cached pages of this relation fork */
+} WallogRelEntry;
+
+typedef struct
+{
+	dlist_head	lru;			/* eviction candidates last */
+	pg_atomic_uint64 hits;
+	pg_atomic_uint64 misses;
+	uint64		evictions;		/* protected by the lock */
+} WallogCacheCtl;
+
+static HTAB *wallog_hash;
+static HTAB *wallog_rel_hash;
+static WallogCacheCtl *wallog_ctl;
+static LWLockId wallog_lock;
+int			wallog_cache_size;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static void wallog_cache_shmem_request(void);
+#endif
+
+/*
+ * Size of a cache entry is 80 bytes. One VM page covers 256 MB of heap, so
+ * this default is enough for the VM of a lot of data, while taking about
+ * 5 MB of shared memory, including the per-relation entries.
+ */
+#define DEFAULT_WALLOG_CACHE_SIZE (64 * 1024)
+
+static Size
+wallog_cache_shmem_size(void)
+{
+	return add_size(sizeof(WallogCacheCtl),
+					add_size(hash_estimate_size(wallog_cache_size, sizeof(WallogEntry)),
+							 hash_estimate_size(wallog_cache_size, sizeof(WallogRelEntry))));
+}
+
+static void
+wallog_cache_shmem_startup(void)
+{
+	static HASHCTL info;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	wallog_lock = (LWLockId) GetNamedLWLockTranche("neon_wallog_cache");
+	wallog_ctl = ShmemInitStruct("neon_wallog_cache_ctl", sizeof(WallogCacheCtl), &found);
+	if (!found)
+	{
+		dlist_init(&wallog_ctl->lru);
+		pg_atomic_init_u64(&wallog_ctl->hits, 0);
+		pg_atomic_init_u64(&wallog_ctl->misses, 0);
+		wallog_ctl->evictions = 0;
+	}
+	info.keysize = sizeof(WallogTag);
+	info.entrysize = sizeof(WallogEntry);
+	wallog_hash = ShmemInitHash("neon_wallog_cache",
+								wallog_cache_size, wallog_cache_size,
+								&info,
+								HASH_ELEM | HASH_BLOBS);
+	/* Every relation fork in the cache has at least one page in it */
+	info.keysize = sizeof(WallogRelTag);
+	info.entrysize = sizeof(WallogRelEntry);
+	wallog_rel_hash = ShmemInitHash("neon_wallog_cache_rels",
+									wallog_cache_size, wallog_cache_size,
+									&info,
+									HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Remove a page from the cache, and its relation fork if it was the last
+ * page of it. The caller must hold the lock exclusively.
+ */
+static void
+wallog_cache_remove(WallogEntry *entry)
+{
+	WallogRelTag reltag;
+	WallogRelEntry *rel;
+
+	dlist_delete(&entry->lru_node);
+	dlist_delete(&entry->rel_node);
+
+	reltag.rnode = entry->tag.rnode;
+	reltag.forknum = entry->tag.forknum;
+	rel = hash_search(wallog_rel_hash, &reltag, HASH_FIND, NULL);
+	if (rel != NULL && dlist_is_empty(&rel->pages))
+		hash_search(wallog_rel_hash, &reltag, HASH_REMOVE, NULL);
+
+	hash_search(wallog_hash, &entry->tag, HASH_REMOVE, NULL);
+}
+
+/*
+ * Compute the hash of a page image to remember in the cache.
+ */
+uint64
+wallog_cache_page_hash(char *buffer)
+{
+	return hash_bytes_extended((const unsigned char *) buffer, BLCKSZ, 0);
+}
+
+/*
+ * Check if the page was already logged with the same contents. If so,
+ * return true and set *lsn to the LSN of the record that logged it.
+ */
+bool
+wallog_cache_lookup(RelFileNode rnode, ForkNumber forknum, BlockNumber blkno,
+					uint64 hash, XLogRecPtr *lsn)
+{
+	bool		found = false;
+
+	if (wallog_cache_size > 0)
+	{
+		WallogTag	tag;
+		WallogEntry *entry;
+
+		tag.rnode = rnode;
+		tag.forknum = forknum;
+		tag.blkno = blkno;
+		LWLockAcquire(wallog_lock, LW_SHARED);
+		entry = hash_search(wallog_hash, &tag, HASH_FIND, NULL);
+		if (entry != NULL && entry->hash == hash)
+		{
+			*lsn = entry->lsn;
+			found = true;
+			pg_atomic_write_u32(&entry->referenced, 1);
+		}
+		LWLockRelease(wallog_lock);
+
+		pg_atomic_fetch_add_u64(found ? &wallog_ctl->hits : &wallog_ctl->misses, 1);
+	}
+	return found;
+}
+
+/*
+ * Remember that the page with the given contents was logged at 'lsn'.
+ *
+ * If the cache is full, a page that has not been looked up since the last
+ * pass of the clock is forgotten to make room.
+ */
+void
+wallog_cache_remember(RelFileNode rnode, ForkNumber forknum, BlockNumber blkno,
+					  uint64 hash, XLogRecPtr lsn)
+{
+	if (wallog_cache_size > 0)
+	{
+		WallogTag	tag;
+		WallogEntry *entry;
+		bool		found;
+
+		tag.rnode = rnode;
+		tag.forknum = forknum;
+		tag.blkno = blkno;
+		LWLockAcquire(wallog_lock, LW_EXCLUSIVE);
+		entry = hash_search(wallog_hash, &tag, HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			WallogRelTag reltag;
+			WallogRelEntry *rel;
+
+			/*
+			 * Give referenced pages a second chance. This terminates, as
+			 * every page is unreferenced on its way back to the head.
+			 */
+			while (hash_get_num_entries(wallog_hash) >= wallog_cache_size)
+			{
+				WallogEntry *victim = dlist_tail_element(WallogEntry, lru_node, &wallog_ctl->lru);
+
+				if (pg_atomic_read_u32(&victim->referenced) != 0)
+				{
+					pg_atomic_write_u32(&victim->referenced, 0);
+					dlist_move_head(&wallog_ctl->lru, &victim->lru_node);
+					continue;
+				}
+				wallog_cache_remove(victim);
+				wallog_ctl->evictions++;
+			}
+
+			entry = hash_search(wallog_hash, &tag, HASH_ENTER, NULL);
+			pg_atomic_init_u32(&entry->referenced, 0);
+
+			reltag.rnode = rnode;
+			reltag.forknum = forknum;
+			rel = hash_search(wallog_rel_hash, &reltag, HASH_ENTER, &found);
+			if (!found)
+				dlist_init(&rel->pages);
+			dlist_push_head(&rel->pages, &entry->rel_node);
+			dlist_push_head(&wallog_ctl->lru, &entry->lru_node);
+		}
+		else
+		{
+			/* Logged again with new contents, so it's still in use */
+			pg_atomic_write_u32(&entry->referenced, 0);
+			dlist_move_head(&wallog_ctl->lru, &entry->lru_node);
+		}
+		entry->hash = hash;
+		entry->lsn = lsn;
+		LWLockRelease(wallog_lock);
+	}
+}
+
+/*
+ * Forget all cached pages of a relation fork at or beyond 'nblocks'.
+ *
+ * forknum can be InvalidForkNumber to forget the pages of all forks.
+ */
+void
+wallog_cache_forget(RelFileNode rnode, ForkNumber forknum, BlockNumber nblocks)
+{
+	if (wallog_cache_size > 0)
+	{
+		LWLockAcquire(wallog_lock, LW_EXCLUSIVE);
+		for (ForkNumber fork = 0; fork <= MAX_FORKNUM; fork++)
+		{
+			WallogRelTag reltag;
+			WallogRelEntry *rel;
+			dlist_mutable_iter iter;
+
+			if (forknum != InvalidForkNumber && fork != forknum)
+				continue;
+
+			reltag.rnode = rnode;
+			reltag.forknum = fork;
+			rel = hash_search(wallog_rel_hash, &reltag, HASH_FIND, NULL);
+			if (rel == NULL)
+				continue;
+
+			dlist_foreach_modify(iter, &rel->pages)
+			{
+				WallogEntry *entry = dlist_container(WallogEntry, rel_node, iter.cur);
+
+				if (entry->tag.blkno >= nblocks)
+				{
+					dlist_delete(&entry->lru_node);
+					dlist_delete(&entry->rel_node);
+					hash_search(wallog_hash, &entry->tag, HASH_REMOVE, NULL);
+				}
+			}
+			if (dlist_is_empty(&rel->pages))
+				hash_search(wallog_rel_hash, &reltag, HASH_REMOVE, NULL);
+		}
+		LWLockRelease(wallog_lock);
+	}
+}
+
+/*
+ * Get the number of cached pages and the counters of the cache. Returns false
+ * if the cache is disabled.
+ */
+bool
+wallog_cache_get_stats(uint64 *entries, uint64 *hits, uint64 *misses, uint64 *evictions)
+{
+	if (wallog_cache_size == 0)
+		return false;
+
+	LWLockAcquire(wallog_lock, LW_SHARED);
+	*entries = hash_get_num_entries(wallog_hash);
+	*hits = pg_atomic_read_u64(&wallog_ctl->hits);
+	*misses = pg_atomic_read_u64(&wallog_ctl->misses);
+	*evictions = wallog_ctl->evictions;
+	LWLockRelease(wallog_lock);
+	return true;
+}
+
+void
+wallog_cache_init(void)
+{
+	DefineCustomIntVariable("neon.wallog_cache_size",
+							"Sets the maximum number of force-logged VM and FSM pages remembered by neon",
+							"Evicted VM and FSM pages whose contents have not changed since they were last logged are not WAL-logged again.",
+							&wallog_cache_size,
+							DEFAULT_WALLOG_CACHE_SIZE,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	if (wallog_cache_size > 0)
+	{
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = wallog_cache_shmem_request;
+#else
+		RequestAddinShmemSpace(wallog_cache_shmem_size());
+		RequestNamedLWLockTranche("neon_wallog_cache", 1);
+#endif
+
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = wallog_cache_shmem_startup;
+	}
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * shmem_request hook: request additional shared resources.  We'll allocate or
+ * attach to the shared resources in wallog_cache_shmem_startup().
+ */
+static void
+wallog_cache_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(wallog_cache_shmem_size());
+	RequestNamedLWLockTranche("neon_wallog_cache", 1);
+}
+#endif
@@ -35,8 +35,11 @@
 
 #include <signal.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include "access/xact.h"
+#include "executor/instrument.h"
+#include "common/pg_lzcompress.h"
 #include "access/xlogdefs.h"
 #include "access/xlogutils.h"
 #include "access/xloginsert.h"
@@ -50,7 +53,10 @@
 #include "access/xlog.h"
 #include "libpq/pqformat.h"
 #include "replication/slot.h"
+#include "replication/syncrep.h"
 #include "replication/walreceiver.h"
+#include "replication/walsender.h"
+#include "postmaster/autovacuum.h"
 #include "postmaster/bgworker.h"
 #include "postmaster/interrupt.h"
 #include "postmaster/postmaster.h"
@@ -60,6 +66,7 @@
 #include "storage/lwlock.h"
 #include "storage/shmem.h"
 #include "storage/spin.h"
+#include "port/pg_bitutils.h"
 #include "tcop/tcopprot.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
@@ -76,6 +83,16 @@ static bool syncSafekeepers = false;
 char	   *wal_acceptors_list;
 int			wal_acceptor_reconnect_timeout;
 int			wal_acceptor_connect_timeout;
+bool		walproposer_mmap_wal;
+int			walproposer_coalesce_max_delay;
+double		backpressure_kp;
+double		backpressure_kd;
+int			backpressure_max_delay;
+bool		backpressure_fair;
+int			walproposer_compression;
+int			walproposer_recovery_streams;
+int			wal_durability;
+int			sync_safekeepers_straggler_timeout;
 bool		am_wal_proposer;
 
 char	   *neon_timeline_walproposer = NULL;
@@ -86,7 +103,26 @@ char	   *neon_tenant_walproposer = NULL;
 static int	n_safekeepers = 0;
 static int	quorum = 0;
 static Safekeeper safekeeper[MAX_SAFEKEEPERS];
-static XLogRecPtr availableLsn; /* WAL has been generated up to this point */
+static XLogRecPtr availableLsn; /* WAL has been generated up to this point,*
+								 * and can be sent to safekeepers */
+
+/*
+ * Send coalescing. With many small commits, every WAL flush would otherwise
+ * produce a separate AppendRequest of a few hundred bytes to each
+ * safekeeper. When WAL arrives more often than
+ * neon.walproposer_coalesce_max_delay, new WAL is held back for a few
+ * arrival intervals, but no longer than that, so that it goes out in bigger
+ * messages. When WAL arrives less often, e.g. when the system is mostly
+ * idle, it is sent right away.
+ *
+ * heldLsn is the end of the WAL held back, InvalidXLogRecPtr if none.
+ */
+#define COALESCE_INTERVALS 4	/* hold for this many arrival intervals */
+
+static XLogRecPtr heldLsn = InvalidXLogRecPtr;
+static TimestampTz coalesceDeadline = 0;	/* send held WAL at this time */
+static TimestampTz lastWalArrival = 0;
+static int64 walArrivalInterval = 0;	/* moving average, in microseconds */
 static XLogRecPtr lastSentCommitLsn;	/* last commitLsn broadcast to*
 										 * safekeepers */
 static ProposerGreeting greetRequest;
@@ -118,6 +154,95 @@ static TimestampTz last_reconnect_attempt;
 
 static WalproposerShmemState * walprop_shared;
 
+/*
+ * Protects the lag history and the safekeeper statistics in walprop_shared.
+ * Copying them out takes too long for walprop_shared->mutex, which WAL
+ * inserters take to check the backpressure lag.
+ */
+static LWLock *walprop_stats_lock;
+
+/*
+ * Timings of the phases of sync-safekeepers, logged when it's done: start,
+ * connected to the quorum, elected, recovered the missing WAL, and the
+ * quorum synced.
+ */
+static TimestampTz syncStartedAt;
+static TimestampTz syncConnectedAt;
+static TimestampTz syncElectedAt;
+static TimestampTz syncRecoveredAt;
+static TimestampTz syncQuorumSyncedAt;
+
+/*
+ * A range of WAL fetched from one safekeeper by WalProposerRecovery.
+ */
+typedef struct RecoveryStream
+{
+	int			sk;				/* index in safekeeper[] */
+	WalReceiverConn *wrconn;
+	XLogRecPtr	startpos;
+	XLogRecPtr	endpos;
+	XLogRecPtr	pos;			/* WAL is written up to this point */
+	pgsocket	wait_fd;
+	WalPropWriter writer;
+}			RecoveryStream;
+
+/* don't split ranges into pieces smaller than this */
+#define RECOVERY_MIN_STREAM_SIZE ((XLogRecPtr) wal_segment_size)
+
+/*
+ * Window of recent WAL, shared by all the safekeepers.
+ *
+ * Safekeepers that are caught up all stream the same WAL, so rather than
+ * reading it separately for each of them, we read it once into this window
+ * and send each safekeeper the part it needs from there. The window covers
+ * [walWindowStart, walWindowEnd), and follows the tip of the WAL: when it's
+ * full, the older half is discarded. Safekeepers that lag behind the window
+ * are served from a separate catch-up buffer, so that they don't evict the
+ * WAL that the others are streaming.
+ *
+ * Both buffers have room for an AppendRequestHeader in front of the WAL, see
+ * AsyncWriteAppendRequest().
+ */
+#define WAL_WINDOW_SIZE (MAX_SEND_SIZE * 8)
+
+static XLogReaderState *walReader;
+static char *walWindow;
+static XLogRecPtr walWindowStart;
+static XLogRecPtr walWindowEnd;
+static char *walCatchupBuf;
+
+/*
+ * With neon.walproposer_mmap_wal, the WAL segment at the tip of the WAL is
+ * mapped into memory, and new WAL is copied into the window straight from
+ * the page cache, without a read() call for every message.
+ */
+static char *mappedSegment = NULL;
+static XLogSegNo mappedSegNo = 0;
+
+/*
+ * Buffer for compressed AppendRequests, with room for the header and the
+ * compressed size in front. Safekeepers that are caught up get the same
+ * messages, so the last compressed WAL is reused for them.
+ */
+#define APPEND_COMPRESSED_HDR_SIZE (sizeof(AppendRequestHeader) + sizeof(uint32))
+
+static char *compressedBuf;
+static XLogRecPtr compressedBeginLsn = InvalidXLogRecPtr;
+static XLogRecPtr compressedEndLsn = InvalidXLogRecPtr;
+static int32 compressedSize;	/* -1 if the WAL didn't compress */
+
+static const struct config_enum_entry walproposer_compression_options[] = {
+	{"none", SK_COMPRESSION_NONE, false},
+	{"pglz", SK_COMPRESSION_PGLZ, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry wal_durability_options[] = {
+	{"local", WAL_DURABILITY_LOCAL, false},
+	{"quorum", WAL_DURABILITY_QUORUM, false},
+	{NULL, 0, false}
+};
+
 /* Prototypes for private functions */
 static void WalProposerInit(XLogRecPtr flushRecPtr, uint64 systemId);
 static void WalProposerStart(void);
@@ -142,26 +267,42 @@ static term_t GetHighestTerm(TermHistory * th);
 static term_t GetEpoch(Safekeeper *sk);
 static void DetermineEpochStartLsn(void);
 static bool WalProposerRecovery(int donor, TimeLineID timeline, XLogRecPtr startpos, XLogRecPtr endpos);
+static bool RecoveryStreamStart(RecoveryStream * stream, TimeLineID timeline);
+static bool RecoveryStreamReceive(RecoveryStream * stream);
+static bool RecoveryStreamsRun(RecoveryStream * streams, int n_streams, TimeLineID timeline);
 static void SendProposerElected(Safekeeper *sk);
 static void WalProposerStartStreaming(XLogRecPtr startpos);
 static void StartStreaming(Safekeeper *sk);
 static void SendMessageToNode(Safekeeper *sk);
 static void BroadcastAppendRequest(void);
+static bool HoldForCoalescing(XLogRecPtr endpos);
+static void ReleaseHeldWAL(void);
 static void HandleActiveState(Safekeeper *sk, uint32 events);
 static bool SendAppendRequests(Safekeeper *sk);
+static char *GetWALToSend(XLogRecPtr beginLsn, XLogRecPtr endLsn);
 static bool RecvAppendResponses(Safekeeper *sk);
 static void CombineHotStanbyFeedbacks(HotStandbyFeedback * hs);
 static XLogRecPtr CalculateMinFlushLsn(void);
 static XLogRecPtr GetAcknowledgedByQuorumWALPosition(void);
 static void HandleSafekeeperResponse(void);
+static void CheckSyncSafekeepersDone(void);
+static void FinishSyncSafekeepers(void);
 static bool AsyncRead(Safekeeper *sk, char **buf, int *buf_size);
 static bool AsyncReadMessage(Safekeeper *sk, AcceptorProposerMessage * anymsg);
 static bool BlockingWrite(Safekeeper *sk, void *msg, size_t msg_size, SafekeeperState success_state);
 static bool AsyncWrite(Safekeeper *sk, void *msg, size_t msg_size, SafekeeperState flush_state);
 static bool AsyncFlush(Safekeeper *sk);
-
+static PGAsyncWriteResult AsyncWriteAppendRequest(Safekeeper *sk, char *wal);
+
+static void TrackAppendRequest(Safekeeper *sk, XLogRecPtr endLsn, TimestampTz now);
+static int64 AckAppendRequests(Safekeeper *sk, XLogRecPtr flushLsn, TimestampTz now);
+static void PublishSafekeeperStats(Safekeeper *sk, uint64 bytesSent, int64 rttUs);
+static void PublishSafekeeperError(Safekeeper *sk, const char *error);
+static void UpdateSafekeeperRtt(Safekeeper *sk, int64 rttUs);
+static bool SafekeeperFaster(Safekeeper *a, Safekeeper *b);
 static void nwp_shmem_startup_hook(void);
 static void nwp_register_gucs(void);
+static void nwp_apply_wal_durability(void);
 static void nwp_prepare_shmem(void);
 static uint64 backpressure_lag_impl(void);
 static bool backpressure_throttling_impl(void);
@@ -181,6 +322,8 @@ pg_init_walproposer(void)
 
 	nwp_register_gucs();
 
+	nwp_apply_wal_durability();
+
 	nwp_prepare_shmem();
 
 	delay_backend_us = &backpressure_lag_impl;
@@ -273,6 +416,140 @@ nwp_register_gucs(void)
 							PGC_SIGHUP,
 							GUC_UNIT_MS,
 							NULL, NULL, NULL);
+
+	DefineCustomRealVariable(
+							 "neon.backpressure_kp",
+							 "Backpressure delay per MB of replication lag over the limit, in microseconds.",
+							 NULL,
+							 &backpressure_kp,
+							 1000, 0, 1e9,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomRealVariable(
+							 "neon.backpressure_kd",
+							 "Backpressure delay per MB/s of growth of the replication lag, in microseconds.",
+							 NULL,
+							 &backpressure_kd,
+							 100, 0, 1e9,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"neon.backpressure_max_delay",
+							"Maximum delay of a backend throttled by backpressure before checking the lag again, in microseconds.",
+							NULL,
+							&backpressure_max_delay,
+							10000, 100, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+							 "neon.backpressure_fair",
+							 "Throttle backends that generate the most WAL first.",
+							 NULL,
+							 &backpressure_fair,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"neon.walproposer_coalesce_max_delay",
+							"Maximum time to hold back WAL to send it to safekeepers in bigger messages, in microseconds.",
+							"WAL is held back only when it is generated more often than this, and for at least a millisecond, so values below 1000 disable send coalescing like zero does.",
+							&walproposer_coalesce_max_delay,
+							0, 0, 100000,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable(
+							 "neon.walproposer_compression",
+							 "Compression of the WAL sent to safekeepers.",
+							 "Safekeepers that don't support the method get uncompressed WAL.",
+							 &walproposer_compression,
+							 SK_COMPRESSION_NONE,
+							 walproposer_compression_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"neon.walproposer_recovery_streams",
+							"Maximum number of safekeepers to fetch missing WAL from concurrently after election.",
+							NULL,
+							&walproposer_recovery_streams,
+							3, 1, MAX_SAFEKEEPERS,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable(
+							 "neon.wal_durability",
+							 "Where committed WAL must be durable before a commit returns.",
+							 "In \"quorum\" mode, commits wait for the safekeepers, and fsync is turned off for the whole cluster, data files included. Only valid if the compute is re-created rather than restarted after an OS crash.",
+							 &wal_durability,
+							 WAL_DURABILITY_LOCAL,
+							 wal_durability_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"neon.sync_safekeepers_straggler_timeout",
+							"Time sync-safekeepers waits for the other alive safekeepers after the quorum has synced.",
+							"-1 waits until all alive safekeepers have synced.",
+							&sync_safekeepers_straggler_timeout,
+							-1, -1, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+							 "neon.walproposer_mmap_wal",
+							 "Read new WAL to send to safekeepers through a memory mapping of the WAL segment.",
+							 NULL,
+							 &walproposer_mmap_wal,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+}
+
+/*
+ * In quorum durability mode, a commit is durable once the safekeepers have
+ * acknowledged it: backends wait for that in SyncRepWaitForLSN(), as the
+ * walproposer reports the position acknowledged by the quorum as its flush
+ * position. Local fsyncs of the WAL are then redundant, so turn them off.
+ *
+ * This overrides fsync for the whole cluster, not only for the WAL: data
+ * files, SLRUs and pg_control aren't fsynced either. That is only valid
+ * because a compute is never restarted from its local data directory after
+ * an OS crash; it is re-created from the pageserver and the safekeepers.
+ * It is also only safe if commits actually wait for the walproposer, so
+ * keep fsync if there are no safekeepers or synchronous replication is off.
+ */
+static void
+nwp_apply_wal_durability(void)
+{
+	if (wal_durability != WAL_DURABILITY_QUORUM)
+		return;
+
+	if (*wal_acceptors_list == '\0' || SyncRepStandbyNames == NULL ||
+		*SyncRepStandbyNames == '\0')
+	{
+		ereport(WARNING,
+				(errmsg("neon.wal_durability = quorum requires neon.safekeepers and synchronous_standby_names, keeping fsync")));
+		return;
+	}
+
+	SetConfigOption("fsync", "off", PGC_POSTMASTER, PGC_S_OVERRIDE);
+	ereport(LOG,
+			(errmsg("WAL durability is provided by the safekeeper quorum, fsync disabled")));
 }
 
 /* shmem handling */
@@ -285,6 +562,7 @@ nwp_prepare_shmem(void)
 	shmem_request_hook = walproposer_shmem_request;
 #else
 	RequestAddinShmemSpace(WalproposerShmemSize());
+	RequestNamedLWLockTranche("neon_walproposer_stats", 1);
 #endif
 	prev_shmem_startup_hook_type = shmem_startup_hook;
 	shmem_startup_hook = nwp_shmem_startup_hook;
@@ -302,6 +580,7 @@ walproposer_shmem_request(void)
 		prev_shmem_request_hook();
 
 	RequestAddinShmemSpace(WalproposerShmemSize());
+	RequestNamedLWLockTranche("neon_walproposer_stats", 1);
 }
 #endif
 
@@ -370,11 +649,70 @@ WalProposerMain(Datum main_arg)
 void
 WalProposerBroadcast(XLogRecPtr startpos, XLogRecPtr endpos)
 {
-	Assert(startpos == availableLsn && endpos >= availableLsn);
+	Assert(startpos == (heldLsn != InvalidXLogRecPtr ? heldLsn : availableLsn));
+	Assert(endpos >= startpos);
+
+	if (HoldForCoalescing(endpos))
+	{
+		heldLsn = endpos;
+		return;
+	}
+
+	heldLsn = InvalidXLogRecPtr;
+	coalesceDeadline = 0;
 	availableLsn = endpos;
 	BroadcastAppendRequest();
 }
 
+/*
+ * Should new WAL up to endpos be held back for send coalescing?
+ */
+static bool
+HoldForCoalescing(XLogRecPtr endpos)
+{
+	TimestampTz now;
+
+	if (walproposer_coalesce_max_delay <= 0)
+		return false;
+
+	now = GetCurrentTimestamp();
+	if (lastWalArrival != 0)
+	{
+		int64		interval = now - lastWalArrival;
+
+		if (walArrivalInterval == 0)
+			walArrivalInterval = interval;
+		else
+			walArrivalInterval = (walArrivalInterval * 7 + interval) / 8;
+	}
+	lastWalArrival = now;
+
+	/* Enough for a full message, or WAL arrives too slowly to wait for more */
+	if (endpos - availableLsn >= MAX_SEND_SIZE ||
+		walArrivalInterval >= walproposer_coalesce_max_delay)
+		return false;
+
+	if (coalesceDeadline == 0)
+		coalesceDeadline = now + Min(walproposer_coalesce_max_delay,
+									 walArrivalInterval * COALESCE_INTERVALS);
+
+	/* Less than a millisecond is too short to wait for, see WalProposerPoll */
+	return coalesceDeadline - now >= 1000;
+}
+
+/*
+ * Send the WAL held back for coalescing.
+ */
+static void
+ReleaseHeldWAL(void)
+{
+	Assert(heldLsn != InvalidXLogRecPtr);
+	availableLsn = heldLsn;
+	heldLsn = InvalidXLogRecPtr;
+	coalesceDeadline = 0;
+	BroadcastAppendRequest();
+}
+
 /*
  * Advance the WAL proposer state machine, waiting each time for events to occur.
  * Will exit only when latch is set, i.e. new WAL should be pushed from walsender
@@ -385,39 +723,124 @@ WalProposerPoll(void)
 {
 	while (true)
 	{
-		Safekeeper *sk;
 		int			rc;
-		WaitEvent	event;
+		WaitEvent	events[MAX_SAFEKEEPERS + 2];
+		uint64		connGenerations[MAX_SAFEKEEPERS];
+		bool		advanced[MAX_SAFEKEEPERS];
 		TimestampTz now = GetCurrentTimestamp();
+		long		timeout = TimeToReconnect(now);
+		bool		reconnectDue = (timeout == 0);
+		bool		coalesceWait = false;
+		bool		latchSet = false;
+
+		/*
+		 * Wake up to send the WAL held for coalescing. The wait has
+		 * millisecond resolution, so the timeout is rounded down, and once
+		 * less than a millisecond of the hold is left, the WAL is sent right
+		 * away. That keeps the hold within neon.walproposer_coalesce_max_delay
+		 * without spinning on a zero timeout until the deadline.
+		 */
+		if (heldLsn != InvalidXLogRecPtr && coalesceDeadline - now < 1000)
+			ReleaseHeldWAL();
+		if (heldLsn != InvalidXLogRecPtr)
+		{
+			long		coalesceTimeout = (coalesceDeadline - now) / 1000;
+
+			if (timeout < 0 || coalesceTimeout < timeout)
+			{
+				timeout = coalesceTimeout;
+				coalesceWait = true;
+			}
+		}
+
+		/* Wake up when sync-safekeepers stops waiting for stragglers */
+		if (syncSafekeepers && syncQuorumSyncedAt != 0 &&
+			sync_safekeepers_straggler_timeout >= 0)
+		{
+			long		stragglerTimeout = Max(syncQuorumSyncedAt +
+											   sync_safekeepers_straggler_timeout * (int64) 1000 - now, 0) / 1000;
 
-		rc = WaitEventSetWait(waitEvents, TimeToReconnect(now),
-							  &event, 1, WAIT_EVENT_WAL_SENDER_MAIN);
-		sk = (Safekeeper *) event.user_data;
+			if (timeout < 0 || stragglerTimeout < timeout)
+				timeout = stragglerTimeout;
+		}
 
 		/*
-		 * If the event contains something that one of our safekeeper states
-		 * was waiting for, we'll advance its state.
+		 * Collect all the ready events at once: when the safekeepers ack a
+		 * commit, they typically all become readable together.
 		 */
-		if (rc != 0 && (event.events & (WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE)))
-			AdvancePollState(sk, event.events);
+		rc = WaitEventSetWait(waitEvents, timeout,
+							  events, n_safekeepers + 1, WAIT_EVENT_WAL_SENDER_MAIN);
+
+		for (int i = 0; i < n_safekeepers; i++)
+		{
+			connGenerations[i] = safekeeper[i].connGeneration;
+			advanced[i] = false;
+		}
+
+		for (int i = 0; i < rc; i++)
+		{
+			Safekeeper *sk = (Safekeeper *) events[i].user_data;
+
+			if (events[i].events & WL_LATCH_SET)
+				latchSet = true;
+
+			if (!(events[i].events & (WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE)))
+				continue;
+
+			/*
+			 * Handling an earlier event may have changed the state of this
+			 * safekeeper, so the event might not be what it's waiting for
+			 * anymore. In particular, if the connection was reset, the event
+			 * is about the old socket, even if the new connection waits for
+			 * the same kind of event. It will be reported again by the next
+			 * wait if it still applies.
+			 */
+			if (sk->connGeneration != connGenerations[sk - safekeeper] ||
+				sk->conn == NULL ||
+				!(events[i].events & SafekeeperStateDesiredEvents(sk->state)))
+				continue;
+
+			/*
+			 * If the event contains something that one of our safekeeper
+			 * states was waiting for, we'll advance its state.
+			 */
+			AdvancePollState(sk, events[i].events);
+			advanced[sk - safekeeper] = true;
+		}
+
+		/* Publish the new states once per safekeeper, not once per event */
+		for (int i = 0; i < n_safekeepers; i++)
+		{
+			if (advanced[i])
+				PublishSafekeeperStats(&safekeeper[i], 0, -1);
+		}
 
 		/*
 		 * If the timeout expired, attempt to reconnect to any safekeepers
-		 * that we dropped
+		 * that we dropped. When woken up by events before that, don't bother:
+		 * the next iteration will wait no longer than the remaining time.
 		 */
-		ReconnectSafekeepers();
+		if (rc == 0 || reconnectDue)
+			ReconnectSafekeepers();
+
+		if (syncSafekeepers && rc == 0)
+			CheckSyncSafekeepersDone();
 
 		/*
 		 * If wait is terminated by latch set (walsenders' latch is set on
 		 * each wal flush), then exit loop. (no need for pm death check due to
 		 * WL_EXIT_ON_PM_DEATH)
 		 */
-		if (rc != 0 && (event.events & WL_LATCH_SET))
+		if (latchSet)
 		{
 			ResetLatch(MyLatch);
 			break;
 		}
-		if (rc == 0)			/* timeout expired: poll state */
+
+		if (heldLsn != InvalidXLogRecPtr && GetCurrentTimestamp() >= coalesceDeadline)
+			ReleaseHeldWAL();
+
+		if (rc == 0 && !coalesceWait)	/* timeout expired: poll state */
 		{
 			TimestampTz now;
 
@@ -514,20 +937,38 @@ WalProposerInit(XLogRecPtr flushRecPtr, uint64 systemId)
 		 */
 		safekeeper[n_safekeepers].conninfo[0] = '\0';
 		initStringInfo(&safekeeper[n_safekeepers].outbuf);
-		safekeeper[n_safekeepers].xlogreader = XLogReaderAllocate(wal_segment_size, NULL, XL_ROUTINE(.segment_open = wal_segment_open,.segment_close = wal_segment_close), NULL);
-		if (safekeeper[n_safekeepers].xlogreader == NULL)
-			elog(FATAL, "Failed to allocate xlog reader");
 		safekeeper[n_safekeepers].flushWrite = false;
 		safekeeper[n_safekeepers].startStreamingAt = InvalidXLogRecPtr;
 		safekeeper[n_safekeepers].streamingAt = InvalidXLogRecPtr;
+		safekeeper[n_safekeepers].sentHead = 0;
+		safekeeper[n_safekeepers].sentCount = 0;
+		safekeeper[n_safekeepers].rtt = 0;
 		n_safekeepers += 1;
 	}
 	if (n_safekeepers < 1)
 	{
 		elog(FATAL, "Safekeepers addresses are not specified");
 	}
+	if (!syncSafekeepers)
+	{
+		LWLockAcquire(walprop_stats_lock, LW_EXCLUSIVE);
+		memset(walprop_shared->safekeeperStats, 0, sizeof(walprop_shared->safekeeperStats));
+		for (int i = 0; i < n_safekeepers; i++)
+			snprintf(walprop_shared->safekeeperStats[i].address, SK_STATS_ADDRESS_LEN,
+					 "%s:%s", safekeeper[i].host, safekeeper[i].port);
+		walprop_shared->numSafekeepers = n_safekeepers;
+		LWLockRelease(walprop_stats_lock);
+	}
 	quorum = n_safekeepers / 2 + 1;
 
+	walReader = XLogReaderAllocate(wal_segment_size, NULL, XL_ROUTINE(.segment_open = wal_segment_open,.segment_close = wal_segment_close), NULL);
+	if (walReader == NULL)
+		elog(FATAL, "Failed to allocate xlog reader");
+	walWindow = palloc(sizeof(AppendRequestHeader) + WAL_WINDOW_SIZE);
+	walWindowStart = walWindowEnd = InvalidXLogRecPtr;
+	walCatchupBuf = palloc(sizeof(AppendRequestHeader) + MAX_SEND_SIZE);
+	compressedBuf = palloc(APPEND_COMPRESSED_HDR_SIZE + PGLZ_MAX_OUTPUT(MAX_SEND_SIZE));
+
 	/* Fill the greeting package */
 	greetRequest.tag = 'g';
 	greetRequest.protocolVersion = SK_PROTOCOL_VERSION;
@@ -552,6 +993,7 @@ WalProposerInit(XLogRecPtr flushRecPtr, uint64 systemId)
 	greetRequest.timeline = ThisTimeLineID;
 #endif
 	greetRequest.walSegSize = wal_segment_size;
+	greetRequest.compression = walproposer_compression;
 
 	InitEventSet();
 }
@@ -559,6 +1001,8 @@ WalProposerInit(XLogRecPtr flushRecPtr, uint64 systemId)
 static void
 WalProposerStart(void)
 {
+	if (syncSafekeepers)
+		syncStartedAt = GetCurrentTimestamp();
 
 	/* Initiate connections to all safekeeper nodes */
 	for (int i = 0; i < n_safekeepers; i++)
@@ -652,11 +1096,20 @@ static void
 ShutdownConnection(Safekeeper *sk)
 {
 	if (sk->conn)
+	{
+		char	   *error = walprop_error_message(sk->conn);
+
+		if (error != NULL && *error != '\0')
+			PublishSafekeeperError(sk, error);
 		walprop_finish(sk->conn);
+	}
 	sk->conn = NULL;
+	sk->connGeneration++;
 	sk->state = SS_OFFLINE;
 	sk->flushWrite = false;
 	sk->streamingAt = InvalidXLogRecPtr;
+	sk->sentCount = 0;
+	PublishSafekeeperStats(sk, 0, -1);
 
 	if (sk->voteResponse.termHistory.entries)
 		pfree(sk->voteResponse.termHistory.entries);
@@ -681,6 +1134,13 @@ ResetConnection(Safekeeper *sk)
 		ShutdownConnection(sk);
 	}
 
+	if (sk->startedConnAt != 0 && !syncSafekeepers)
+	{
+		LWLockAcquire(walprop_stats_lock, LW_EXCLUSIVE);
+		walprop_shared->safekeeperStats[sk - safekeeper].reconnects++;
+		LWLockRelease(walprop_stats_lock);
+	}
+
 	/*
 	 * Try to establish new connection
 	 *
@@ -1039,6 +1499,7 @@ SendProposerGreeting(Safekeeper *sk)
 	 * On failure, logging & resetting the connection is handled. We just need
 	 * to handle the control flow.
 	 */
+	sk->greetingSentAt = GetCurrentTimestamp();
 	BlockingWrite(sk, &greetRequest, sizeof(greetRequest), SS_HANDSHAKE_RECV);
 }
 
@@ -1054,6 +1515,8 @@ RecvAcceptorGreeting(Safekeeper *sk)
 	if (!AsyncReadMessage(sk, (AcceptorProposerMessage *) & sk->greetResponse))
 		return;
 
+	UpdateSafekeeperRtt(sk, GetCurrentTimestamp() - sk->greetingSentAt);
+
 	/* Protocol is all good, move to voting. */
 	sk->state = SS_VOTING;
 
@@ -1066,6 +1529,9 @@ RecvAcceptorGreeting(Safekeeper *sk)
 		/* Quorum is acquried, prepare the vote request. */
 		if (n_connected == quorum)
 		{
+			if (syncSafekeepers)
+				syncConnectedAt = GetCurrentTimestamp();
+
 			propTerm++;
 			elog(LOG, "proposer connected to quorum (%d) safekeepers, propTerm=" INT64_FORMAT, quorum, propTerm);
 
@@ -1187,6 +1653,9 @@ RecvVoteResponse(Safekeeper *sk)
 static void
 HandleElectedProposer(void)
 {
+	if (syncSafekeepers)
+		syncElectedAt = GetCurrentTimestamp();
+
 	DetermineEpochStartLsn();
 
 	/*
@@ -1203,12 +1672,14 @@ HandleElectedProposer(void)
 		/* Perform recovery */
 		if (!WalProposerRecovery(donor, greetRequest.timeline, truncateLsn, propEpochStartLsn))
 			elog(FATAL, "Failed to recover state");
+		if (syncSafekeepers)
+			syncRecoveredAt = GetCurrentTimestamp();
 	}
 	else if (syncSafekeepers)
 	{
 		/* Sync is not needed: just exit */
-		fprintf(stdout, "%X/%X\n", LSN_FORMAT_ARGS(propEpochStartLsn));
-		exit(0);
+		syncRecoveredAt = syncQuorumSyncedAt = GetCurrentTimestamp();
+		FinishSyncSafekeepers();
 	}
 
 	for (int i = 0; i < n_safekeepers; i++)
@@ -1292,9 +1763,16 @@ DetermineEpochStartLsn(void)
 	{
 		if (safekeeper[i].state == SS_IDLE)
 		{
+			/*
+			 * Among equally advanced safekeepers, prefer the fastest one as
+			 * the donor.
+			 */
 			if (GetEpoch(&safekeeper[i]) > donorEpoch ||
 				(GetEpoch(&safekeeper[i]) == donorEpoch &&
-				 safekeeper[i].voteResponse.flushLsn > propEpochStartLsn))
+				 safekeeper[i].voteResponse.flushLsn > propEpochStartLsn) ||
+				(GetEpoch(&safekeeper[i]) == donorEpoch &&
+				 safekeeper[i].voteResponse.flushLsn == propEpochStartLsn &&
+				 SafekeeperFaster(&safekeeper[i], &safekeeper[donor])))
 			{
 				donorEpoch = GetEpoch(&safekeeper[i]);
 				propEpochStartLsn = safekeeper[i].voteResponse.flushLsn;
@@ -1397,94 +1875,230 @@ DetermineEpochStartLsn(void)
 }
 
 /*
- * Receive WAL from most advanced safekeeper
+ * Receive WAL from the most advanced safekeepers.
+ *
+ * Safekeepers which voted for us and are in the same epoch as the donor have
+ * the same WAL as the donor up to their flush position, so if several of them
+ * have all of [startpos, endpos), the range is split between them and the
+ * pieces are fetched concurrently, each written at its offset. Pieces that
+ * couldn't be fetched are then fetched from the donor.
  */
 static bool
 WalProposerRecovery(int donor, TimeLineID timeline, XLogRecPtr startpos, XLogRecPtr endpos)
 {
+	RecoveryStream streams[MAX_SAFEKEEPERS];
+	int			sources[MAX_SAFEKEEPERS];
+	int			n_sources = 0;
+	int			n_streams;
+	XLogRecPtr	chunk;
+
+	/* donor first, so that it fetches the beginning of the range */
+	sources[n_sources++] = donor;
+	for (int i = 0; i < n_safekeepers; i++)
+	{
+		if (i != donor && safekeeper[i].state == SS_IDLE &&
+			GetEpoch(&safekeeper[i]) == donorEpoch &&
+			safekeeper[i].voteResponse.flushLsn >= endpos)
+		{
+			int			j;
+
+			/* keep the others sorted by RTT, to use the fastest ones */
+			for (j = n_sources; j > 1 && SafekeeperFaster(&safekeeper[i], &safekeeper[sources[j - 1]]); j--)
+				sources[j] = sources[j - 1];
+			sources[j] = i;
+			n_sources++;
+		}
+	}
+
+	n_streams = Min(n_sources, Max(walproposer_recovery_streams, 1));
+	n_streams = Min(n_streams, Max((endpos - startpos) / RECOVERY_MIN_STREAM_SIZE, 1));
+	chunk = (endpos - startpos) / n_streams;
+	chunk -= chunk % XLOG_BLCKSZ;
+
+	for (int i = 0; i < n_streams; i++)
+	{
+		streams[i].sk = sources[i];
+		streams[i].startpos = startpos + i * chunk;
+		streams[i].endpos = (i == n_streams - 1) ? endpos : startpos + (i + 1) * chunk;
+	}
+
+	if (!RecoveryStreamsRun(streams, n_streams, timeline))
+	{
+		int			n_failed = 0;
+
+		/* Retry the missing parts from the donor, one at a time */
+		for (int i = 0; i < n_streams; i++)
+		{
+			if (streams[i].pos >= streams[i].endpos)
+				continue;
+			if (streams[i].sk == donor)
+				return false;
+			streams[n_failed] = streams[i];
+			streams[n_failed].sk = donor;
+			streams[n_failed].startpos = streams[i].pos;
+			n_failed++;
+		}
+		for (int i = 0; i < n_failed; i++)
+		{
+			if (!RecoveryStreamsRun(&streams[i], 1, timeline))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Fetch the WAL of all the streams concurrently. Returns true if all of it
+ * was written; otherwise stream->pos tells how far each stream got.
+ */
+static bool
+RecoveryStreamsRun(RecoveryStream * streams, int n_streams, TimeLineID timeline)
+{
+	int			n_active = 0;
+	bool		ok = true;
+
+	for (int i = 0; i < n_streams; i++)
+	{
+		streams[i].pos = streams[i].startpos;
+		XLogWalPropInit(&streams[i].writer);
+		if (RecoveryStreamStart(&streams[i], timeline))
+			n_active++;
+	}
+
+	while (n_active > 0)
+	{
+		WaitEventSet *wes;
+		WaitEvent	event;
+
+		for (int i = 0; i < n_streams; i++)
+		{
+			if (streams[i].wrconn != NULL && !RecoveryStreamReceive(&streams[i]))
+				n_active--;
+		}
+		if (n_active == 0)
+			break;
+
+		wes = CreateWaitEventSet(CurrentMemoryContext, n_active + 2);
+		AddWaitEventToSet(wes, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+		AddWaitEventToSet(wes, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+		for (int i = 0; i < n_streams; i++)
+		{
+			if (streams[i].wrconn != NULL)
+				AddWaitEventToSet(wes, WL_SOCKET_READABLE, streams[i].wait_fd, NULL, NULL);
+		}
+		(void) WaitEventSetWait(wes, -1, &event, 1, WAIT_EVENT_WAL_RECEIVER_MAIN);
+		FreeWaitEventSet(wes);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	for (int i = 0; i < n_streams; i++)
+	{
+		XLogWalPropFinish(&streams[i].writer);
+		if (streams[i].pos < streams[i].endpos)
+			ok = false;
+	}
+	return ok;
+}
+
+/*
+ * Connect to the safekeeper of the stream and start streaming from its
+ * start position.
+ */
+static bool
+RecoveryStreamStart(RecoveryStream * stream, TimeLineID timeline)
+{
+	Safekeeper *sk = &safekeeper[stream->sk];
 	char		conninfo[MAXCONNINFO];
 	char	   *err;
-	WalReceiverConn *wrconn;
 	WalRcvStreamOptions options;
 
+	stream->wrconn = NULL;
+	stream->wait_fd = PGINVALID_SOCKET;
+
 	sprintf(conninfo, "host=%s port=%s dbname=replication options='-c timeline_id=%s tenant_id=%s'",
-			safekeeper[donor].host, safekeeper[donor].port, neon_timeline_walproposer, neon_tenant_walproposer);
-	wrconn = walrcv_connect(conninfo, false, "wal_proposer_recovery", &err);
-	if (!wrconn)
+			sk->host, sk->port, neon_timeline_walproposer, neon_tenant_walproposer);
+	stream->wrconn = walrcv_connect(conninfo, false, "wal_proposer_recovery", &err);
+	if (!stream->wrconn)
 	{
 		ereport(WARNING,
 				(errmsg("could not connect to WAL acceptor %s:%s: %s",
-						safekeeper[donor].host, safekeeper[donor].port,
+						sk->host, sk->port,
 						err)));
 		return false;
 	}
 	elog(LOG,
 		 "start recovery from %s:%s starting from %X/%08X till %X/%08X timeline "
 		 "%d",
-		 safekeeper[donor].host, safekeeper[donor].port, (uint32) (startpos >> 32),
-		 (uint32) startpos, (uint32) (endpos >> 32), (uint32) endpos, timeline);
+		 sk->host, sk->port, LSN_FORMAT_ARGS(stream->startpos),
+		 LSN_FORMAT_ARGS(stream->endpos), timeline);
 
 	options.logical = false;
-	options.startpoint = startpos;
+	options.startpoint = stream->startpos;
 	options.slotname = NULL;
 	options.proto.physical.startpointTLI = timeline;
 
-	if (walrcv_startstreaming(wrconn, &options))
-	{
-		XLogRecPtr	rec_start_lsn;
-		XLogRecPtr	rec_end_lsn = 0;
-		int			len;
-		char	   *buf;
-		pgsocket	wait_fd = PGINVALID_SOCKET;
-
-		while ((len = walrcv_receive(wrconn, &buf, &wait_fd)) >= 0)
-		{
-			if (len == 0)
-			{
-				(void) WaitLatchOrSocket(
-										 MyLatch, WL_EXIT_ON_PM_DEATH | WL_SOCKET_READABLE, wait_fd,
-										 -1, WAIT_EVENT_WAL_RECEIVER_MAIN);
-			}
-			else
-			{
-				Assert(buf[0] == 'w' || buf[0] == 'k');
-				if (buf[0] == 'k')
-					continue;	/* keepalive */
-				memcpy(&rec_start_lsn, &buf[XLOG_HDR_START_POS],
-					   sizeof rec_start_lsn);
-				rec_start_lsn = pg_ntoh64(rec_start_lsn);
-				rec_end_lsn = rec_start_lsn + len - XLOG_HDR_SIZE;
-
-				/* write WAL to disk */
-				XLogWalPropWrite(&buf[XLOG_HDR_SIZE], len - XLOG_HDR_SIZE, rec_start_lsn);
-
-				ereport(DEBUG1,
-						(errmsg("Recover message %X/%X length %d",
-								LSN_FORMAT_ARGS(rec_start_lsn), len)));
-				if (rec_end_lsn >= endpos)
-					break;
-			}
-		}
-		ereport(LOG,
-				(errmsg("end of replication stream at %X/%X: %m",
-						LSN_FORMAT_ARGS(rec_end_lsn))));
-		walrcv_disconnect(wrconn);
-
-		/* failed to receive all WAL till endpos */
-		if (rec_end_lsn < endpos)
-			return false;
-	}
-	else
+	if (!walrcv_startstreaming(stream->wrconn, &options))
 	{
 		ereport(LOG,
 				(errmsg("primary server contains no more WAL on requested timeline %u LSN %X/%08X",
-						timeline, (uint32) (startpos >> 32), (uint32) startpos)));
+						timeline, LSN_FORMAT_ARGS(stream->startpos))));
+		walrcv_disconnect(stream->wrconn);
+		stream->wrconn = NULL;
 		return false;
 	}
-
 	return true;
 }
 
+/*
+ * Write the WAL received on the stream so far to disk. Returns false, after
+ * disconnecting, when the stream has ended.
+ */
+static bool
+RecoveryStreamReceive(RecoveryStream * stream)
+{
+	Safekeeper *sk = &safekeeper[stream->sk];
+	XLogRecPtr	rec_start_lsn;
+	int			len;
+	char	   *buf;
+
+	while ((len = walrcv_receive(stream->wrconn, &buf, &stream->wait_fd)) >= 0)
+	{
+		if (len == 0)
+			return true;		/* wait for more */
+
+		Assert(buf[0] == 'w' || buf[0] == 'k');
+		if (buf[0] == 'k')
+			continue;			/* keepalive */
+		memcpy(&rec_start_lsn, &buf[XLOG_HDR_START_POS],
+			   sizeof rec_start_lsn);
+		rec_start_lsn = pg_ntoh64(rec_start_lsn);
+		buf += XLOG_HDR_SIZE;
+		len -= XLOG_HDR_SIZE;
+
+		/* the rest of the range is fetched by another stream */
+		if (rec_start_lsn + len > stream->endpos)
+			len = stream->endpos - rec_start_lsn;
+
+		/* write WAL to disk */
+		XLogWalPropWrite(&stream->writer, buf, len, rec_start_lsn);
+		stream->pos = rec_start_lsn + len;
+
+		ereport(DEBUG1,
+				(errmsg("Recover message %X/%X length %d from %s:%s",
+						LSN_FORMAT_ARGS(rec_start_lsn), len, sk->host, sk->port)));
+		if (stream->pos >= stream->endpos)
+			break;
+	}
+	ereport(LOG,
+			(errmsg("end of replication stream from %s:%s at %X/%X",
+					sk->host, sk->port, LSN_FORMAT_ARGS(stream->pos))));
+	walrcv_disconnect(stream->wrconn);
+	stream->wrconn = NULL;
+	return false;
+}
+
 /*
  * Determine for sk the starting streaming point and send it message
  * 1) Announcing we are elected proposer (which immediately advances epoch if
@@ -1668,9 +2282,24 @@ SendMessageToNode(Safekeeper *sk)
 static void
 BroadcastAppendRequest()
 {
+	Safekeeper *order[MAX_SAFEKEEPERS];
+
+	/*
+	 * Send to the fastest safekeepers first, so that slow ones don't delay
+	 * the quorum.
+	 */
+	for (int i = 0; i < n_safekeepers; i++)
+	{
+		int			j;
+
+		for (j = i; j > 0 && SafekeeperFaster(&safekeeper[i], order[j - 1]); j--)
+			order[j] = order[j - 1];
+		order[j] = &safekeeper[i];
+	}
+
 	for (int i = 0; i < n_safekeepers; i++)
-		if (safekeeper[i].state == SS_ACTIVE)
-			SendMessageToNode(&safekeeper[i]);
+		if (order[i]->state == SS_ACTIVE)
+			SendMessageToNode(order[i]);
 }
 
 static void
@@ -1733,7 +2362,6 @@ SendAppendRequests(Safekeeper *sk)
 	XLogRecPtr	endLsn;
 	AppendRequestHeader *req;
 	PGAsyncWriteResult writeResult;
-	WALReadError errinfo;
 	bool		sentAnything = false;
 
 	if (sk->flushWrite)
@@ -1774,33 +2402,18 @@ SendAppendRequests(Safekeeper *sk)
 						LSN_FORMAT_ARGS(req->commitLsn),
 						LSN_FORMAT_ARGS(truncateLsn), sk->host, sk->port)));
 
-		resetStringInfo(&sk->outbuf);
+		writeResult = AsyncWriteAppendRequest(sk, GetWALToSend(req->beginLsn, req->endLsn));
 
-		/* write AppendRequest header */
-		appendBinaryStringInfo(&sk->outbuf, (char *) req, sizeof(AppendRequestHeader));
+		/* Mark current message as sent, whatever the result is */
+		sk->streamingAt = endLsn;
 
-		/* write the WAL itself */
-		enlargeStringInfo(&sk->outbuf, req->endLsn - req->beginLsn);
-		if (!WALRead(sk->xlogreader,
-					 &sk->outbuf.data[sk->outbuf.len],
-					 req->beginLsn,
-					 req->endLsn - req->beginLsn,
-#if PG_VERSION_NUM >= 150000
-		/* FIXME don't use hardcoded timeline_id here */
-					 1,
-#else
-					 ThisTimeLineID,
-#endif
-					 &errinfo))
+		if (writeResult != PG_ASYNC_WRITE_FAIL)
 		{
-			WALReadRaiseError(&errinfo);
-		}
-		sk->outbuf.len += req->endLsn - req->beginLsn;
-
-		writeResult = walprop_async_write(sk->conn, sk->outbuf.data, sk->outbuf.len);
+			TimestampTz now = GetCurrentTimestamp();
 
-		/* Mark current message as sent, whatever the result is */
-		sk->streamingAt = endLsn;
+			TrackAppendRequest(sk, endLsn, now);
+			PublishSafekeeperStats(sk, req->endLsn - req->beginLsn, -1);
+		}
 
 		switch (writeResult)
 		{
@@ -1834,9 +2447,200 @@ SendAppendRequests(Safekeeper *sk)
 }
 
 /*
- * Receive and process all available feedback.
- *
- * Can change state if Async* functions encounter errors and reset connection.
+ * Read WAL between beginLsn and endLsn into 'buf'.
+ */
+static void
+ReadWAL(char *buf, XLogRecPtr beginLsn, XLogRecPtr endLsn)
+{
+	WALReadError errinfo;
+
+	if (!WALRead(walReader,
+				 buf,
+				 beginLsn,
+				 endLsn - beginLsn,
+#if PG_VERSION_NUM >= 150000
+	/* FIXME don't use hardcoded timeline_id here */
+				 1,
+#else
+				 ThisTimeLineID,
+#endif
+				 &errinfo))
+	{
+		WALReadRaiseError(&errinfo);
+	}
+}
+
+/*
+ * Copy WAL between beginLsn and endLsn into 'buf' from the mapped segment
+ * at the tip of the WAL, mapping a new segment if needed. Returns false if
+ * the WAL is in an older segment or the segment couldn't be mapped; the
+ * caller should read it with ReadWAL() then.
+ *
+ * Only the segment at the tip is mapped. WAL files are recycled by renaming
+ * them, so a mapping of an old segment could start showing new WAL after a
+ * while, but segments that the safekeepers haven't received yet are kept by
+ * our replication slot.
+ */
+static bool
+ReadWALFromMappedSegment(char *buf, XLogRecPtr beginLsn, XLogRecPtr endLsn)
+{
+	while (beginLsn < endLsn)
+	{
+		XLogSegNo	segno;
+		uint32		offset;
+		Size		nbytes;
+
+		XLByteToSeg(beginLsn, segno, wal_segment_size);
+		if (mappedSegment == NULL || segno != mappedSegNo)
+		{
+			char		path[MAXPGPATH];
+			TimeLineID	tli;
+			int			fd;
+			void	   *segment;
+
+			if (mappedSegment != NULL && segno < mappedSegNo)
+				return false;
+
+#if PG_VERSION_NUM >= 150000
+			/* FIXME don't use hardcoded timeline_id here */
+			tli = 1;
+#else
+			tli = ThisTimeLineID;
+#endif
+			XLogFilePath(path, tli, segno, wal_segment_size);
+			fd = BasicOpenFile(path, O_RDONLY | PG_BINARY);
+			if (fd < 0)
+				return false;
+			segment = mmap(NULL, wal_segment_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (segment == MAP_FAILED)
+			{
+				elog(LOG, "could not map WAL segment \"%s\": %m", path);
+				return false;
+			}
+
+			if (mappedSegment != NULL)
+				munmap(mappedSegment, wal_segment_size);
+			mappedSegment = segment;
+			mappedSegNo = segno;
+		}
+
+		offset = XLogSegmentOffset(beginLsn, wal_segment_size);
+		nbytes = Min(endLsn - beginLsn, wal_segment_size - offset);
+		memcpy(buf, mappedSegment + offset, nbytes);
+
+		buf += nbytes;
+		beginLsn += nbytes;
+	}
+	return true;
+}
+
+/*
+ * Get the WAL between beginLsn and endLsn to send to a safekeeper, from the
+ * shared WAL window if possible. The returned pointer is valid until the
+ * next call.
+ */
+static char *
+GetWALToSend(XLogRecPtr beginLsn, XLogRecPtr endLsn)
+{
+	char	   *data = walWindow + sizeof(AppendRequestHeader);
+
+	Assert(endLsn - beginLsn <= MAX_SEND_SIZE);
+
+	/* Lagging safekeeper, don't disturb the window */
+	if (beginLsn < walWindowStart)
+	{
+		ReadWAL(walCatchupBuf + sizeof(AppendRequestHeader), beginLsn, endLsn);
+		return walCatchupBuf + sizeof(AppendRequestHeader);
+	}
+
+	/* Not adjacent to the window, start a new one */
+	if (beginLsn > walWindowEnd || walWindowEnd == InvalidXLogRecPtr)
+		walWindowStart = walWindowEnd = beginLsn;
+
+	if (endLsn > walWindowEnd)
+	{
+		/*
+		 * If it doesn't fit, discard the older half of the window. Moving
+		 * half of the window at a time keeps the cost of the copying
+		 * proportional to the amount of WAL streamed.
+		 */
+		if (endLsn - walWindowStart > WAL_WINDOW_SIZE)
+		{
+			XLogRecPtr	newStart = endLsn - WAL_WINDOW_SIZE / 2;
+
+			/* a message is no bigger than half of the window */
+			Assert(newStart <= beginLsn);
+
+			memmove(data, data + (newStart - walWindowStart), walWindowEnd - newStart);
+			walWindowStart = newStart;
+		}
+		if (!walproposer_mmap_wal ||
+			!ReadWALFromMappedSegment(data + (walWindowEnd - walWindowStart), walWindowEnd, endLsn))
+			ReadWAL(data + (walWindowEnd - walWindowStart), walWindowEnd, endLsn);
+		walWindowEnd = endLsn;
+	}
+
+	return data + (beginLsn - walWindowStart);
+}
+
+/*
+ * Send sk->appendRequest with the WAL at 'wal', which must come from
+ * GetWALToSend().
+ *
+ * The header and the WAL must be sent as one CopyData message. To avoid
+ * copying the WAL into a per-safekeeper buffer just to put the header in
+ * front of it, the header is written in place before the WAL, and the
+ * bytes it overwrites are restored after libpq has copied the message.
+ *
+ * If the safekeeper accepted compression in the greeting, the WAL is sent
+ * compressed instead, unless it doesn't compress.
+ */
+static PGAsyncWriteResult
+AsyncWriteAppendRequest(Safekeeper *sk, char *wal)
+{
+	AppendRequestHeader *req = &sk->appendRequest;
+	char		saved[sizeof(AppendRequestHeader)];
+	char	   *msg = wal - sizeof(AppendRequestHeader);
+	PGAsyncWriteResult writeResult;
+
+	if (sk->greetResponse.compression == SK_COMPRESSION_PGLZ &&
+		req->endLsn - req->beginLsn >= PGLZ_strategy_default->min_input_size)
+	{
+		if (req->beginLsn != compressedBeginLsn || req->endLsn != compressedEndLsn)
+		{
+			compressedSize = pglz_compress(wal, req->endLsn - req->beginLsn,
+										   compressedBuf + APPEND_COMPRESSED_HDR_SIZE,
+										   PGLZ_strategy_default);
+			compressedBeginLsn = req->beginLsn;
+			compressedEndLsn = req->endLsn;
+		}
+
+		if (compressedSize >= 0)
+		{
+			uint32		size = compressedSize;
+
+			memcpy(compressedBuf, req, sizeof(AppendRequestHeader));
+			((AppendRequestHeader *) compressedBuf)->tag = 'z';
+			memcpy(compressedBuf + sizeof(AppendRequestHeader), &size, sizeof(uint32));
+			return walprop_async_write(sk->conn, compressedBuf,
+									   APPEND_COMPRESSED_HDR_SIZE + compressedSize);
+		}
+	}
+
+	memcpy(saved, msg, sizeof(AppendRequestHeader));
+	memcpy(msg, req, sizeof(AppendRequestHeader));
+	writeResult = walprop_async_write(sk->conn, msg,
+									  sizeof(AppendRequestHeader) + req->endLsn - req->beginLsn);
+	memcpy(msg, saved, sizeof(AppendRequestHeader));
+
+	return writeResult;
+}
+
+/*
+ * Receive and process all available feedback.
+ *
+ * Can change state if Async* functions encounter errors and reset connection.
  * Returns false in this case, true otherwise.
  *
  * NB: This function can call SendMessageToNode and produce new messages.
@@ -1846,6 +2650,8 @@ RecvAppendResponses(Safekeeper *sk)
 {
 	XLogRecPtr	minQuorumLsn;
 	bool		readAnything = false;
+	TimestampTz now;
+	int64		rtt;
 
 	while (true)
 	{
@@ -1873,6 +2679,12 @@ RecvAppendResponses(Safekeeper *sk)
 				 sk->appendResponse.term, propTerm);
 		}
 
+		now = GetCurrentTimestamp();
+		rtt = AckAppendRequests(sk, sk->appendResponse.flushLsn, now);
+		if (rtt >= 0)
+			UpdateSafekeeperRtt(sk, rtt);
+		PublishSafekeeperStats(sk, 0, rtt);
+
 		readAnything = true;
 	}
 
@@ -1894,6 +2706,142 @@ RecvAppendResponses(Safekeeper *sk)
 	return sk->state == SS_ACTIVE;
 }
 
+/*
+ * Remember that an AppendRequest up to endLsn was sent to the safekeeper.
+ */
+static void
+TrackAppendRequest(Safekeeper *sk, XLogRecPtr endLsn, TimestampTz now)
+{
+	SentAppendRequest *req;
+
+	if (sk->sentCount == SK_SENT_REQUESTS)
+		return;
+
+	req = &sk->sentRequests[(sk->sentHead + sk->sentCount) % SK_SENT_REQUESTS];
+	req->endLsn = endLsn;
+	req->sentAt = now;
+	sk->sentCount++;
+}
+
+/*
+ * Forget the AppendRequests acknowledged by a response with flushLsn.
+ * Returns the round trip time of the last one, or -1 if none was.
+ */
+static int64
+AckAppendRequests(Safekeeper *sk, XLogRecPtr flushLsn, TimestampTz now)
+{
+	int64		rtt = -1;
+
+	while (sk->sentCount > 0 && sk->sentRequests[sk->sentHead].endLsn <= flushLsn)
+	{
+		rtt = Max(now - sk->sentRequests[sk->sentHead].sentAt, 0);
+		sk->sentHead = (sk->sentHead + 1) % SK_SENT_REQUESTS;
+		sk->sentCount--;
+	}
+	return rtt;
+}
+
+/*
+ * Fold a round trip time sample into the smoothed RTT of the safekeeper,
+ * like TCP does.
+ */
+static void
+UpdateSafekeeperRtt(Safekeeper *sk, int64 rttUs)
+{
+	rttUs = Max(rttUs, 1);
+	if (sk->rtt == 0)
+		sk->rtt = rttUs;
+	else
+		sk->rtt = (sk->rtt * 7 + rttUs) / 8;
+}
+
+/*
+ * Is safekeeper a known to have a lower round trip time than b?
+ */
+static bool
+SafekeeperFaster(Safekeeper *a, Safekeeper *b)
+{
+	return a->rtt != 0 && (b->rtt == 0 || a->rtt < b->rtt);
+}
+
+/*
+ * Update the shared statistics of the safekeeper with its current state,
+ * and account bytesSent and the round trip time rttUs, if it's not -1.
+ */
+static void
+PublishSafekeeperStats(Safekeeper *sk, uint64 bytesSent, int64 rttUs)
+{
+	SafekeeperStats *stats;
+	XLogRecPtr	flushLsn = sk->appendResponse.flushLsn;
+
+	if (syncSafekeepers)
+		return;
+
+	stats = &walprop_shared->safekeeperStats[sk - safekeeper];
+
+	LWLockAcquire(walprop_stats_lock, LW_EXCLUSIVE);
+	stats->state = sk->state;
+	stats->flushLsn = flushLsn;
+	stats->flushLagBytes = (availableLsn > flushLsn) ? availableLsn - flushLsn : 0;
+	stats->oldestUnflushedAt = (sk->sentCount > 0) ?
+		sk->sentRequests[sk->sentHead].sentAt : 0;
+	stats->bytesSent += bytesSent;
+	if (rttUs >= 0)
+	{
+		int			bucket;
+
+		if (rttUs < 16)
+			bucket = 0;
+		else
+			bucket = Min(pg_leftmost_one_pos64(rttUs) - 3, SK_STATS_RTT_BUCKETS - 1);
+		stats->rttBuckets[bucket]++;
+		stats->rttTotalUs += rttUs;
+	}
+	LWLockRelease(walprop_stats_lock);
+}
+
+static void
+PublishSafekeeperError(Safekeeper *sk, const char *error)
+{
+	SafekeeperStats *stats;
+	TimestampTz now = GetCurrentTimestamp();
+	char		msg[SK_STATS_ERROR_LEN];
+	int			len;
+
+	if (syncSafekeepers)
+		return;
+
+	/* libpq error messages end with a newline */
+	strlcpy(msg, error, SK_STATS_ERROR_LEN);
+	len = strlen(msg);
+	while (len > 0 && msg[len - 1] == '\n')
+		msg[--len] = '\0';
+
+	stats = &walprop_shared->safekeeperStats[sk - safekeeper];
+
+	LWLockAcquire(walprop_stats_lock, LW_EXCLUSIVE);
+	memcpy(stats->lastError, msg, SK_STATS_ERROR_LEN);
+	stats->lastErrorTime = now;
+	LWLockRelease(walprop_stats_lock);
+}
+
+/*
+ * Copy the statistics of all safekeepers into 'stats', which must have room
+ * for MAX_SAFEKEEPERS entries. Returns the number of safekeepers.
+ */
+int
+GetSafekeeperStats(SafekeeperStats * stats)
+{
+	int			n;
+
+	LWLockAcquire(walprop_stats_lock, LW_SHARED);
+	n = walprop_shared->numSafekeepers;
+	memcpy(stats, walprop_shared->safekeeperStats, n * sizeof(SafekeeperStats));
+	LWLockRelease(walprop_stats_lock);
+
+	return n;
+}
+
 /* Parse a ReplicationFeedback message, or the ReplicationFeedback part of an AppendResponse */
 void
 ParseReplicationFeedbackMessage(StringInfo reply_message, ReplicationFeedback * rf)
@@ -2046,12 +2994,25 @@ GetAcknowledgedByQuorumWALPosition(void)
 }
 
 /*
- * ReplicationFeedbackShmemSize --- report amount of shared memory space needed
+ * Number of backends, for the per-backend WAL rates. MaxBackends is not
+ * computed yet when the shared memory is requested on PostgreSQL 14, so
+ * compute it the same way InitializeMaxBackends() does.
+ */
+static int
+WalproposerMaxBackends(void)
+{
+	return MaxConnections + autovacuum_max_workers + 1 +
+		max_worker_processes + max_wal_senders;
+}
+
+/*
+ * WalproposerShmemSize --- report amount of shared memory space needed
  */
 Size
 WalproposerShmemSize(void)
 {
-	return sizeof(WalproposerShmemState);
+	return add_size(offsetof(WalproposerShmemState, backendWalRates),
+					mul_size(WalproposerMaxBackends(), sizeof(BackendWalRate)));
 }
 
 bool
@@ -2061,14 +3022,25 @@ WalproposerShmemInit(void)
 
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 	walprop_shared = ShmemInitStruct("Walproposer shared state",
-									 sizeof(WalproposerShmemState),
+									 WalproposerShmemSize(),
 									 &found);
+	walprop_stats_lock = &(GetNamedLWLockTranche("neon_walproposer_stats"))->lock;
 
 	if (!found)
 	{
 		memset(walprop_shared, 0, WalproposerShmemSize());
 		SpinLockInit(&walprop_shared->mutex);
 		pg_atomic_init_u64(&walprop_shared->backpressureThrottlingTime, 0);
+		for (int i = 0; i < BACKPRESSURE_NUM_CAUSES; i++)
+			pg_atomic_init_u64(&walprop_shared->backpressureThrottles[i], 0);
+		for (int i = 0; i < BACKPRESSURE_SLEEP_BUCKETS; i++)
+			pg_atomic_init_u64(&walprop_shared->backpressureSleeps[i], 0);
+		walprop_shared->numBackendWalRates = WalproposerMaxBackends();
+		for (int i = 0; i < walprop_shared->numBackendWalRates; i++)
+		{
+			pg_atomic_init_u64(&walprop_shared->backendWalRates[i].walRate, 0);
+			pg_atomic_init_u64(&walprop_shared->backendWalRates[i].updatedAt, 0);
+		}
 	}
 	LWLockRelease(AddinShmemInitLock);
 
@@ -2078,9 +3050,64 @@ WalproposerShmemInit(void)
 void
 replication_feedback_set(ReplicationFeedback * rf)
 {
+	static TimestampTz lastLagSample = 0;
+	TimestampTz now = GetCurrentTimestamp();
+	bool		sampleLag;
+	BackpressureLagSample sample;
+
+	/* Compute the lag sample outside the locks */
+	sampleLag = TimestampDifferenceExceeds(lastLagSample, now,
+										   BACKPRESSURE_LAG_SAMPLE_INTERVAL / 1000);
+	if (sampleLag)
+	{
+#if PG_VERSION_NUM >= 150000
+		XLogRecPtr	myFlushLsn = GetFlushRecPtr(NULL);
+#else
+		XLogRecPtr	myFlushLsn = GetFlushRecPtr();
+#endif
+
+#define LAG_BEHIND(ptr) ((ptr) != InvalidXLogRecPtr && (ptr) <= myFlushLsn ? (int64) (myFlushLsn - (ptr)) : -1)
+		sample.time = now;
+		sample.writeLag = LAG_BEHIND(rf->ps_writelsn);
+		sample.flushLag = LAG_BEHIND(rf->ps_flushlsn);
+		sample.applyLag = LAG_BEHIND(rf->ps_applylsn);
+#undef LAG_BEHIND
+		lastLagSample = now;
+	}
+
 	SpinLockAcquire(&walprop_shared->mutex);
 	memcpy(&walprop_shared->feedback, rf, sizeof(ReplicationFeedback));
 	SpinLockRelease(&walprop_shared->mutex);
+
+	if (sampleLag)
+	{
+		LWLockAcquire(walprop_stats_lock, LW_EXCLUSIVE);
+		walprop_shared->lagHistory[walprop_shared->numLagSamples % BACKPRESSURE_LAG_HISTORY_SIZE] = sample;
+		walprop_shared->numLagSamples++;
+		LWLockRelease(walprop_stats_lock);
+	}
+}
+
+/*
+ * Copy the lag history into 'samples', which must have room for
+ * BACKPRESSURE_LAG_HISTORY_SIZE samples, oldest first. Returns the number of
+ * samples.
+ */
+int
+BackpressureLagHistory(BackpressureLagSample * samples)
+{
+	uint64		end;
+	uint64		start;
+	int			n = 0;
+
+	LWLockAcquire(walprop_stats_lock, LW_SHARED);
+	end = walprop_shared->numLagSamples;
+	start = end > BACKPRESSURE_LAG_HISTORY_SIZE ? end - BACKPRESSURE_LAG_HISTORY_SIZE : 0;
+	for (uint64 i = start; i < end; i++)
+		samples[n++] = walprop_shared->lagHistory[i % BACKPRESSURE_LAG_HISTORY_SIZE];
+	LWLockRelease(walprop_stats_lock);
+
+	return n;
 }
 
 void
@@ -2220,28 +3247,75 @@ HandleSafekeeperResponse(void)
 	 * wait for all seemingly alive safekeepers to get synced.
 	 */
 	if (syncSafekeepers)
+		CheckSyncSafekeepersDone();
+}
+
+/*
+ * In sync-safekeepers mode, exit if the safekeepers are synced: the quorum
+ * has switched to the new epoch, and so have all the other alive
+ * safekeepers, or neon.sync_safekeepers_straggler_timeout has passed since
+ * the quorum did.
+ */
+static void
+CheckSyncSafekeepersDone(void)
+{
+	int			n_synced = 0;
+	bool		waiting = false;
+
+	if (syncElectedAt == 0)
+		return;					/* not elected yet */
+
+	for (int i = 0; i < n_safekeepers; i++)
 	{
-		int			n_synced;
+		Safekeeper *sk = &safekeeper[i];
+		bool		synced = sk->appendResponse.commitLsn >= propEpochStartLsn;
 
-		n_synced = 0;
-		for (int i = 0; i < n_safekeepers; i++)
-		{
-			Safekeeper *sk = &safekeeper[i];
-			bool		synced = sk->appendResponse.commitLsn >= propEpochStartLsn;
+		/* alive safekeeper which is not synced yet; wait for it */
+		if (sk->state != SS_OFFLINE && !synced)
+			waiting = true;
+		if (synced)
+			n_synced++;
+	}
+	if (n_synced < quorum)
+		return;
 
-			/* alive safekeeper which is not synced yet; wait for it */
-			if (sk->state != SS_OFFLINE && !synced)
-				return;
-			if (synced)
-				n_synced++;
-		}
-		if (n_synced >= quorum)
-		{
-			/* All safekeepers synced! */
-			fprintf(stdout, "%X/%X\n", LSN_FORMAT_ARGS(propEpochStartLsn));
-			exit(0);
-		}
+	if (syncQuorumSyncedAt == 0)
+		syncQuorumSyncedAt = GetCurrentTimestamp();
+
+	if (waiting)
+	{
+		if (sync_safekeepers_straggler_timeout < 0 ||
+			!TimestampDifferenceExceeds(syncQuorumSyncedAt, GetCurrentTimestamp(),
+										sync_safekeepers_straggler_timeout))
+			return;
+		elog(LOG, "not waiting for %d safekeepers to sync after straggler timeout",
+			 n_safekeepers - n_synced);
 	}
+
+	/* All safekeepers synced! */
+	FinishSyncSafekeepers();
+}
+
+/*
+ * Report the sync position and how long the phases took, and exit.
+ */
+static void
+FinishSyncSafekeepers(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+
+#define PHASE_MS(from, to) ((from) != 0 && (to) != 0 ? (long) (((to) - (from)) / 1000) : -1L)
+	elog(LOG, "sync-safekeepers done in %ld ms: connect %ld ms, election %ld ms, recovery %ld ms, sync %ld ms, stragglers %ld ms",
+		 PHASE_MS(syncStartedAt, now),
+		 PHASE_MS(syncStartedAt, syncConnectedAt),
+		 PHASE_MS(syncConnectedAt, syncElectedAt),
+		 PHASE_MS(syncElectedAt, syncRecoveredAt),
+		 PHASE_MS(syncRecoveredAt, syncQuorumSyncedAt),
+		 PHASE_MS(syncQuorumSyncedAt, now));
+#undef PHASE_MS
+
+	fprintf(stdout, "%X/%X\n", LSN_FORMAT_ARGS(propEpochStartLsn));
+	exit(0);
 }
 
 /*
@@ -2313,6 +3387,10 @@ AsyncReadMessage(Safekeeper *sk, AcceptorProposerMessage * anymsg)
 
 				msg->term = pq_getmsgint64_le(&s);
 				msg->nodeId = pq_getmsgint64_le(&s);
+				if (s.cursor < s.len)
+					msg->compression = pq_getmsgint32_le(&s);
+				else
+					msg->compression = SK_COMPRESSION_NONE;
 				pq_getmsgend(&s);
 				return true;
 			}
@@ -2467,9 +3545,12 @@ AsyncFlush(Safekeeper *sk)
 	}
 }
 
-/*  Check if we need to suspend inserts because of lagging replication. */
+/*
+ * Check if we need to suspend inserts because of lagging replication.
+ * Returns the lag over the limit, and sets *cause to the limit exceeded.
+ */
 static uint64
-backpressure_lag_impl(void)
+backpressure_lag_cause(BackpressureCause * cause)
 {
 	if (max_replication_apply_lag > 0 || max_replication_flush_lag > 0 || max_replication_write_lag > 0)
 	{
@@ -2492,16 +3573,19 @@ backpressure_lag_impl(void)
 
 		if ((writePtr != InvalidXLogRecPtr && max_replication_write_lag > 0 && myFlushLsn > writePtr + max_replication_write_lag * MB))
 		{
+			*cause = BACKPRESSURE_WRITE_LAG;
 			return (myFlushLsn - writePtr - max_replication_write_lag * MB);
 		}
 
 		if ((flushPtr != InvalidXLogRecPtr && max_replication_flush_lag > 0 && myFlushLsn > flushPtr + max_replication_flush_lag * MB))
 		{
+			*cause = BACKPRESSURE_FLUSH_LAG;
 			return (myFlushLsn - flushPtr - max_replication_flush_lag * MB);
 		}
 
 		if ((applyPtr != InvalidXLogRecPtr && max_replication_apply_lag > 0 && myFlushLsn > applyPtr + max_replication_apply_lag * MB))
 		{
+			*cause = BACKPRESSURE_APPLY_LAG;
 			return (myFlushLsn - applyPtr - max_replication_apply_lag * MB);
 		}
 	}
@@ -2509,13 +3593,201 @@ backpressure_lag_impl(void)
 }
 
 #define BACK_PRESSURE_DELAY 10000L // 0.01 sec
+#define BACK_PRESSURE_MIN_DELAY 100L	/* 0.1 ms */
+
+/*
+ * Compute how long to sleep before checking the lag again, from the amount
+ * of lag over the limit and its rate of change, as seen by this backend.
+ *
+ * With a fixed delay, writers are stalled for whole 10 ms periods even when
+ * the lag is barely over the limit, and resume at full speed all together,
+ * so the lag oscillates around the limit. Instead, the delay is
+ * proportional to the lag over the limit (neon.backpressure_kp, in
+ * microseconds per MB), plus a term proportional to how fast the lag is
+ * growing (neon.backpressure_kd, in microseconds per MB/s), which reacts to
+ * a burst before the lag has built up, and lets writers go sooner when the
+ * lag is shrinking. The delay is capped by neon.backpressure_max_delay.
+ * With both gains zero, the fixed delay is used.
+ */
+static long
+backpressure_delay(uint64 lag)
+{
+	static uint64 prevLag = 0;
+	static TimestampTz prevTime = 0;
+	TimestampTz now;
+	double		rate = 0;
+	double		delay;
+
+	if (backpressure_kp == 0 && backpressure_kd == 0)
+		return BACK_PRESSURE_DELAY;
+
+	/* Rate of change of the lag since the last check, in bytes per second */
+	now = GetCurrentTimestamp();
+	if (prevTime != 0 && now > prevTime && now - prevTime < USECS_PER_SEC)
+		rate = ((double) lag - (double) prevLag) * USECS_PER_SEC / (now - prevTime);
+	prevLag = lag;
+	prevTime = now;
+
+	delay = backpressure_kp * ((double) lag / MB) + backpressure_kd * (rate / MB);
+	if (delay < BACK_PRESSURE_MIN_DELAY)
+		return BACK_PRESSURE_MIN_DELAY;
+	if (delay > backpressure_max_delay)
+		return backpressure_max_delay;
+	return (long) delay;
+}
+
+/*
+ * Fair backpressure.
+ *
+ * Each backend keeps a moving average of its rate of WAL generation in
+ * shared memory. The rate is sampled from pgWalUsage in the WAL insert path
+ * (delay_backend_us is called for every record inserted) once every
+ * WAL_RATE_SAMPLE_BYTES, and when the backend is throttled. Time spent
+ * sleeping under backpressure is not counted, so a heavy producer that is
+ * held back keeps its rate instead of looking idle.
+ *
+ * When the lag is over the limit, the backends are throttled relative to the
+ * heaviest WAL producer: the ones producing at least half as much WAL as the
+ * heaviest one are held until the lag is under the limit, as before. The
+ * others only sleep once for a fraction of the delay in proportion to their
+ * rate, and continue, so that a small OLTP transaction isn't stalled behind
+ * a bulk load. That is only allowed while the lag is less than twice the
+ * limit, so light producers can't make it grow without bound. Rates not
+ * updated within the last second are ignored.
+ */
+#define WAL_RATE_WINDOW USECS_PER_SEC
+#define WAL_RATE_SAMPLE_BYTES (64 * 1024)
+#define HEAVY_PRODUCER_SHARE 0.5
+
+/* WAL inserted and time slept under backpressure since the last sample */
+static uint64 walRatePrevBytes = 0;
+static TimestampTz walRatePrevTime = 0;
+static int64 walRateSlept = 0;
+
+/*
+ * Update the WAL rate of this backend with the WAL inserted since the last
+ * sample.
+ */
+static void
+backpressure_update_wal_rate(TimestampTz now)
+{
+	BackendWalRate *my;
+	uint64		bytes = pgWalUsage.wal_bytes - walRatePrevBytes;
+	int64		active = now - walRatePrevTime - walRateSlept;
+	double		rate;
+	uint64		myRate;
+
+	if (MyBackendId == InvalidBackendId || MyBackendId > walprop_shared->numBackendWalRates)
+		return;
+	my = &walprop_shared->backendWalRates[MyBackendId - 1];
+
+	if (walRatePrevTime == 0)
+	{
+		/* First WAL of this backend, start measuring from here */
+		walRatePrevBytes = pgWalUsage.wal_bytes;
+		walRatePrevTime = now;
+		walRateSlept = 0;
+		return;
+	}
+
+	if (bytes == 0 || active <= 0)
+	{
+		/* Held by backpressure without inserting anything: keep the rate */
+		pg_atomic_write_u64(&my->updatedAt, now);
+		return;
+	}
+
+	rate = (double) bytes * USECS_PER_SEC / active;
+	myRate = pg_atomic_read_u64(&my->walRate);
+	if (now - (TimestampTz) pg_atomic_read_u64(&my->updatedAt) > WAL_RATE_WINDOW)
+		myRate = (uint64) rate; /* idle, or a new backend in this slot */
+	else
+	{
+		double		alpha = Min((double) active / WAL_RATE_WINDOW, 1.0);
+
+		myRate = (uint64) (myRate + alpha * (rate - (double) myRate));
+	}
+	pg_atomic_write_u64(&my->walRate, myRate);
+	pg_atomic_write_u64(&my->updatedAt, now);
+
+	walRatePrevBytes = pgWalUsage.wal_bytes;
+	walRatePrevTime = now;
+	walRateSlept = 0;
+}
+
+/*
+ * Update the WAL rate of this backend, and return it relative to the
+ * heaviest recent WAL producer, between 0 and 1.
+ */
+static double
+backpressure_wal_share(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	uint64		myRate;
+	uint64		maxRate = 0;
+
+	if (MyBackendId == InvalidBackendId || MyBackendId > walprop_shared->numBackendWalRates)
+		return 1.0;
+
+	backpressure_update_wal_rate(now);
+	myRate = pg_atomic_read_u64(&walprop_shared->backendWalRates[MyBackendId - 1].walRate);
+
+	for (int i = 0; i < walprop_shared->numBackendWalRates; i++)
+	{
+		BackendWalRate *other = &walprop_shared->backendWalRates[i];
+
+		if (now - (TimestampTz) pg_atomic_read_u64(&other->updatedAt) <= WAL_RATE_WINDOW)
+			maxRate = Max(maxRate, pg_atomic_read_u64(&other->walRate));
+	}
+
+	if (maxRate == 0)
+		return 1.0;
+	return (double) Min(myRate, maxRate) / maxRate;
+}
+
+/*
+ * The configured limit for the given cause of backpressure, in bytes.
+ */
+static uint64
+backpressure_limit(BackpressureCause cause)
+{
+	switch (cause)
+	{
+		case BACKPRESSURE_WRITE_LAG:
+			return max_replication_write_lag * MB;
+		case BACKPRESSURE_FLUSH_LAG:
+			return max_replication_flush_lag * MB;
+		case BACKPRESSURE_APPLY_LAG:
+			return max_replication_apply_lag * MB;
+		default:
+			return 0;
+	}
+}
+
+static uint64
+backpressure_lag_impl(void)
+{
+	BackpressureCause cause;
+
+	/* Called for every WAL record inserted, sample the WAL rate every now and then */
+	if (backpressure_fair &&
+		(walRatePrevTime == 0 || pgWalUsage.wal_bytes - walRatePrevBytes >= WAL_RATE_SAMPLE_BYTES))
+		backpressure_update_wal_rate(GetCurrentTimestamp());
+
+	return backpressure_lag_cause(&cause);
+}
 
 static bool
 backpressure_throttling_impl(void)
 {
 	int64		lag;
+	BackpressureCause cause;
+	long		delay;
+	double		share = 1.0;
 	TimestampTz start,
 				stop;
+	uint64		slept;
+	int			bucket;
 	bool		retry = PrevProcessInterruptsCallback
 	? PrevProcessInterruptsCallback()
 	: false;
@@ -2525,19 +3797,44 @@ backpressure_throttling_impl(void)
 		return retry;
 
 	/* Calculate replicas lag */
-	lag = backpressure_lag_impl();
+	lag = backpressure_lag_cause(&cause);
 	if (lag == 0)
 		return retry;
 
 	/* Suspend writers until replicas catch up */
 	set_ps_display("backpressure throttling");
 
-	elog(DEBUG2, "backpressure throttling: lag %lu", lag);
+	delay = backpressure_delay(lag);
+	if (backpressure_fair)
+	{
+		share = backpressure_wal_share();
+		/* Past twice the limit, hold everyone */
+		if (lag >= backpressure_limit(cause))
+			share = 1.0;
+	}
+
+	elog(DEBUG2, "backpressure throttling: lag %lu, WAL share %.2f", lag, share);
 	start = GetCurrentTimestamp();
-	pg_usleep(BACK_PRESSURE_DELAY);
+	pgstat_report_wait_start(WAIT_EVENT_NEON_BACKPRESSURE);
+	if (share >= HEAVY_PRODUCER_SHARE)
+		pg_usleep(delay);
+	else
+		pg_usleep(Max((long) (delay * share), BACK_PRESSURE_MIN_DELAY));
+	pgstat_report_wait_end();
 	stop = GetCurrentTimestamp();
-	pg_atomic_add_fetch_u64(&walprop_shared->backpressureThrottlingTime, stop - start);
-	return true;
+
+	slept = stop - start;
+	walRateSlept += slept;
+	if (slept < 256)
+		bucket = 0;
+	else
+		bucket = Min(pg_leftmost_one_pos64(slept) - 7, BACKPRESSURE_SLEEP_BUCKETS - 1);
+	pg_atomic_add_fetch_u64(&walprop_shared->backpressureThrottlingTime, slept);
+	pg_atomic_fetch_add_u64(&walprop_shared->backpressureThrottles[cause], 1);
+	pg_atomic_fetch_add_u64(&walprop_shared->backpressureSleeps[bucket], 1);
+
+	/* Light producers go on after one delay, heavy ones wait for the lag */
+	return share >= HEAVY_PRODUCER_SHARE ? true : retry;
 }
 
 uint64
@@ -2545,3 +3842,15 @@ BackpressureThrottlingTime(void)
 {
 	return pg_atomic_read_u64(&walprop_shared->backpressureThrottlingTime);
 }
+
+/*
+ * Get the number of backpressure sleeps per cause, and their histogram.
+ */
+void
+BackpressureThrottlingStats(uint64 *throttles, uint64 *sleeps)
+{
+	for (int i = 0; i < BACKPRESSURE_NUM_CAUSES; i++)
+		throttles[i] = pg_atomic_read_u64(&walprop_shared->backpressureThrottles[i]);
+	for (int i = 0; i < BACKPRESSURE_SLEEP_BUCKETS; i++)
+		sleeps[i] = pg_atomic_read_u64(&walprop_shared->backpressureSleeps[i]);
+}
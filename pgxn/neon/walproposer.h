@@ -13,6 +13,23 @@
 #define SK_MAGIC 0xCafeCeefu
 #define SK_PROTOCOL_VERSION 2
 
+/*
+ * Compression of the WAL in AppendRequests, negotiated in the greeting. A
+ * compressed AppendRequest has tag 'z', and the header is followed by the
+ * size of the compressed WAL as uint32 and the compressed WAL.
+ */
+#define SK_COMPRESSION_NONE 0
+#define SK_COMPRESSION_PGLZ 1
+
+/*
+ * Where committed WAL is durable, see neon.wal_durability. In quorum mode
+ * commits wait for the safekeepers, and fsync is turned off for the whole
+ * cluster, not just the WAL: after a crash the compute is re-created from
+ * the pageserver and the safekeepers, never restarted from its local files.
+ */
+#define WAL_DURABILITY_LOCAL 0
+#define WAL_DURABILITY_QUORUM 1
+
 #define MAX_SAFEKEEPERS 32
 #define MAX_SEND_SIZE (XLOG_BLCKSZ * 16)	/* max size of a single* WAL
 											 * message */
@@ -31,6 +48,16 @@
 extern char *wal_acceptors_list;
 extern int	wal_acceptor_reconnect_timeout;
 extern int	wal_acceptor_connect_timeout;
+extern bool walproposer_mmap_wal;
+extern int	walproposer_coalesce_max_delay;
+extern double backpressure_kp;
+extern double backpressure_kd;
+extern int	backpressure_max_delay;
+extern bool backpressure_fair;
+extern int	walproposer_compression;
+extern int	walproposer_recovery_streams;
+extern int	wal_durability;
+extern int	sync_safekeepers_straggler_timeout;
 extern bool am_wal_proposer;
 
 struct WalProposerConn;			/* Defined in libpqwalproposer */
@@ -174,6 +201,12 @@ typedef struct ProposerGreeting
 	uint8		tenant_id[16];
 	TimeLineID	timeline;
 	uint32		walSegSize;
+
+	/*
+	 * SK_COMPRESSION_* methods the proposer can use for AppendRequests.
+	 * Safekeepers that don't know about compression ignore it.
+	 */
+	uint32		compression;
 }			ProposerGreeting;
 
 typedef struct AcceptorProposerMessage
@@ -189,6 +222,9 @@ typedef struct AcceptorGreeting
 	AcceptorProposerMessage apm;
 	term_t		term;
 	NNodeId		nodeId;
+	uint32		compression;	/* SK_COMPRESSION_* method accepted by the
+								 * safekeeper, sent only if the proposer
+								 * asked for compression */
 }			AcceptorGreeting;
 
 /*
@@ -294,12 +330,101 @@ typedef struct ReplicationFeedback
 	TimestampTz ps_replytime;
 }			ReplicationFeedback;
 
+/*
+ * Rate of WAL generation of a backend, for fair backpressure. Only the
+ * backend itself updates its entry.
+ */
+typedef struct BackendWalRate
+{
+	pg_atomic_uint64 walRate;	/* bytes per second, moving average */
+	pg_atomic_uint64 updatedAt; /* TimestampTz of the last update */
+}			BackendWalRate;
+
+/*
+ * Replication lag at a point in time, in bytes. -1 if the position is not
+ * known.
+ */
+typedef struct BackpressureLagSample
+{
+	TimestampTz time;
+	int64		writeLag;
+	int64		flushLag;
+	int64		applyLag;
+}			BackpressureLagSample;
+
+/* one sample per second over the last 10 minutes */
+#define BACKPRESSURE_LAG_HISTORY_SIZE 600
+#define BACKPRESSURE_LAG_SAMPLE_INTERVAL USECS_PER_SEC
+
+/*
+ * Reason of a backpressure throttling: the first of max_replication_write_lag,
+ * max_replication_flush_lag and max_replication_apply_lag that is exceeded.
+ */
+typedef enum
+{
+	BACKPRESSURE_WRITE_LAG,
+	BACKPRESSURE_FLUSH_LAG,
+	BACKPRESSURE_APPLY_LAG,
+	BACKPRESSURE_NUM_CAUSES
+}			BackpressureCause;
+
+/*
+ * Histogram of backpressure sleeps: bucket 0 counts sleeps shorter than
+ * 256 us, bucket i sleeps shorter than 2^(i+8) us, and the last bucket the
+ * longer ones.
+ */
+#define BACKPRESSURE_SLEEP_BUCKETS 16
+
+/*
+ * Statistics of the connection to a safekeeper, published by the walproposer
+ * for neon_safekeeper_stats() and protected by the mutex of
+ * WalproposerShmemState.
+ *
+ * The append RTT is the time from sending an AppendRequest until a response
+ * acknowledges that its WAL is flushed. Bucket 0 of the RTT histogram counts
+ * round trips faster than 16 us, bucket i below (16 << i) us, and the last
+ * bucket the slower ones.
+ */
+#define SK_STATS_RTT_BUCKETS 20
+#define SK_STATS_ADDRESS_LEN 128
+#define SK_STATS_ERROR_LEN 256
+
+typedef struct SafekeeperStats
+{
+	char		address[SK_STATS_ADDRESS_LEN];	/* host:port */
+	SafekeeperState state;
+	XLogRecPtr	flushLsn;
+	int64		flushLagBytes;	/* WAL generated but not flushed yet */
+	TimestampTz oldestUnflushedAt;	/* when the oldest unflushed
+									 * AppendRequest was sent, or 0 */
+	uint64		bytesSent;		/* WAL bytes, before compression */
+	uint64		reconnects;
+	uint64		rttTotalUs;
+	uint64		rttBuckets[SK_STATS_RTT_BUCKETS];
+	TimestampTz lastErrorTime;
+	char		lastError[SK_STATS_ERROR_LEN];
+}			SafekeeperStats;
+
 typedef struct WalproposerShmemState
 {
 	slock_t		mutex;
 	ReplicationFeedback feedback;
 	term_t		mineLastElectedTerm;
 	pg_atomic_uint64 backpressureThrottlingTime;
+	pg_atomic_uint64 backpressureThrottles[BACKPRESSURE_NUM_CAUSES];
+	pg_atomic_uint64 backpressureSleeps[BACKPRESSURE_SLEEP_BUCKETS];
+
+	/* lag history, a ring buffer protected by the neon_walproposer_stats lock */
+	uint64		numLagSamples;	/* total number of samples taken */
+	BackpressureLagSample lagHistory[BACKPRESSURE_LAG_HISTORY_SIZE];
+
+	/* safekeeper statistics, protected by the neon_walproposer_stats lock */
+	int			numSafekeepers;
+	SafekeeperStats safekeeperStats[MAX_SAFEKEEPERS];
+
+	int			numBackendWalRates;
+	BackendWalRate backendWalRates[FLEXIBLE_ARRAY_MEMBER];	/* indexed by
+															 * BackendId - 1 */
 }			WalproposerShmemState;
 
 /*
@@ -333,6 +458,17 @@ typedef struct AppendResponse
 /*
  * Descriptor of safekeeper
  */
+/*
+ * An AppendRequest sent to a safekeeper and not acknowledged yet.
+ */
+typedef struct SentAppendRequest
+{
+	XLogRecPtr	endLsn;
+	TimestampTz sentAt;
+}			SentAppendRequest;
+
+#define SK_SENT_REQUESTS 64
+
 typedef struct Safekeeper
 {
 	char const *host;
@@ -349,15 +485,11 @@ typedef struct Safekeeper
 	WalProposerConn *conn;
 
 	/*
-	 * Temporary buffer for the message being sent to the safekeeper.
+	 * Temporary buffer for the message being sent to the safekeeper. WAL is
+	 * sent from the window shared by all safekeepers instead.
 	 */
 	StringInfoData outbuf;
 
-	/*
-	 * WAL reader, allocated for each safekeeper.
-	 */
-	XLogReaderState *xlogreader;
-
 	/*
 	 * Streaming will start here; must be record boundary.
 	 */
@@ -370,11 +502,28 @@ typedef struct Safekeeper
 
 	int			eventPos;		/* position in wait event set. Equal to -1 if*
 								 * no event */
+	uint64		connGeneration; /* incremented when the connection is closed */
 	SafekeeperState state;		/* safekeeper state machine state */
 	TimestampTz startedConnAt;	/* when connection attempt started */
 	AcceptorGreeting greetResponse; /* acceptor greeting */
 	VoteResponse voteResponse;	/* the vote */
 	AppendResponse appendResponse;	/* feedback for master */
+
+	/*
+	 * AppendRequests in flight, oldest first, to measure the append round
+	 * trip time. A ring buffer; when it's full, new requests are not tracked.
+	 */
+	SentAppendRequest sentRequests[SK_SENT_REQUESTS];
+	int			sentHead;
+	int			sentCount;
+
+	/*
+	 * Smoothed round trip time in microseconds, 0 if not measured yet.
+	 * Measured on the greeting and on AppendRequests, and kept across
+	 * reconnections.
+	 */
+	TimestampTz greetingSentAt;
+	int64		rtt;
 } Safekeeper;
 
 extern PGDLLIMPORT void WalProposerMain(Datum main_arg);
@@ -505,5 +654,8 @@ extern PGAsyncWriteResult walprop_async_write(WalProposerConn *conn, void const
 extern bool walprop_blocking_write(WalProposerConn *conn, void const *buf, size_t size);
 
 extern uint64 BackpressureThrottlingTime(void);
+extern void BackpressureThrottlingStats(uint64 *throttles, uint64 *sleeps);
+extern int	BackpressureLagHistory(BackpressureLagSample * samples);
+extern int	GetSafekeeperStats(SafekeeperStats * stats);
 
 #endif							/* __NEON_WALPROPOSER_H__ */
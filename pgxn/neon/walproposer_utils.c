@@ -13,12 +13,15 @@
 #include "walproposer_utils.h"
 #include "replication/walsender_private.h"
 
+#include "storage/fd.h"
 #include "storage/ipc.h"
 #include "utils/builtins.h"
 #include "utils/ps_status.h"
 
 #include "libpq-fe.h"
 #include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #if PG_VERSION_NUM >= 150000
@@ -27,13 +30,17 @@
 #endif
 
 /*
- * These variables are used similarly to openLogFile/SegNo,
- * but for walproposer to write the XLOG during recovery. walpropFileTLI is the TimeLineID
- * corresponding the filename of walpropFile.
+ * WAL passed to XLogWalPropWrite is collected in the buffer of the
+ * WalPropWriter and written out in large chunks, when the buffer is full,
+ * reaches the end of a segment, or the next piece of WAL is not contiguous
+ * with it. The buffer never spans segments. XLogWalPropFlush must be called
+ * before the WAL is used.
+ *
+ * Segments are preallocated one ahead of the write position, when the
+ * writes reach the middle of the previous one, so that creating them doesn't
+ * stall the writes.
  */
-static int	walpropFile = -1;
-static TimeLineID walpropFileTLI = 0;
-static XLogSegNo walpropSegNo = 0;
+#define WALPROP_WRITE_BUF_SIZE (XLOG_BLCKSZ * 128)	/* 1 MB */
 
 /* START cloned file-local variables and functions from walsender.c */
 
@@ -396,54 +403,149 @@ pq_sendint64_le(StringInfo buf, uint64 i)
 	buf->len += sizeof(uint64);
 }
 
+static TimeLineID
+XLogWalPropTLI(void)
+{
+#if PG_VERSION_NUM >= 150000
+	/* FIXME Is it ok to use hardcoded value here? */
+	return 1;
+#else
+	return ThisTimeLineID;
+#endif
+}
+
 /*
- * Write XLOG data to disk.
+ * Create the WAL segment 'segno' with its full size, if it doesn't exist.
+ * Uses posix_fallocate() when available, which reserves the space without
+ * writing zeros, and XLogFileInit() otherwise.
  */
-void
-XLogWalPropWrite(char *buf, Size nbytes, XLogRecPtr recptr)
+static void
+XLogWalPropPreallocate(XLogSegNo segno)
 {
-	int			startoff;
-	int			byteswritten;
+	char		path[MAXPGPATH];
+	struct stat stat_buf;
 
-	while (nbytes > 0)
-	{
-		int			segbytes;
+	XLogFilePath(path, XLogWalPropTLI(), segno, wal_segment_size);
+	if (stat(path, &stat_buf) == 0)
+		return;
 
-		/* Close the current segment if it's completed */
-		if (walpropFile >= 0 && !XLByteInSeg(recptr, walpropSegNo, wal_segment_size))
-			XLogWalPropClose(recptr);
+#ifdef HAVE_POSIX_FALLOCATE
+	{
+		char		tmppath[MAXPGPATH];
+		int			fd;
+		int			rc;
+
+		snprintf(tmppath, MAXPGPATH, XLOGDIR "/xlogtemp.%d", (int) getpid());
+		unlink(tmppath);
+		fd = BasicOpenFile(tmppath, O_RDWR | O_CREAT | O_EXCL | PG_BINARY);
+		if (fd < 0)
+		{
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not create file \"%s\": %m", tmppath)));
+			return;
+		}
 
-		if (walpropFile < 0)
+		/* Failing to preallocate is not fatal, the segment is created later */
+		rc = posix_fallocate(fd, 0, wal_segment_size);
+		close(fd);
+		if (rc != 0)
 		{
+			errno = rc;
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not preallocate file \"%s\": %m", tmppath)));
+			unlink(tmppath);
+			return;
+		}
+
+		/*
+		 * Use link() rather than rename(), so as not to replace a segment
+		 * created concurrently by the WAL writer.
+		 */
+		if (link(tmppath, path) != 0 && errno != EEXIST)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not link file \"%s\" to \"%s\": %m",
+							tmppath, path)));
+		unlink(tmppath);
+	}
+#else
+	{
+		int			fd;
 #if PG_VERSION_NUM >= 150000
-			/* FIXME Is it ok to use hardcoded value here? */
-			TimeLineID	tli = 1;
+		fd = XLogFileInit(segno, XLogWalPropTLI());
 #else
-			bool		use_existent = true;
+		bool		use_existent = true;
+
+		fd = XLogFileInit(segno, &use_existent, false);
+#endif
+		close(fd);
+	}
+#endif
+}
+
+/*
+ * Prepare the writer for use.
+ */
+void
+XLogWalPropInit(WalPropWriter * writer)
+{
+	writer->file = -1;
+	writer->fileTLI = 0;
+	writer->segNo = 0;
+	writer->preallocSegNo = 0;
+	writer->buf = NULL;
+	writer->bufStart = InvalidXLogRecPtr;
+	writer->bufLen = 0;
+}
+
+/*
+ * Write the buffered XLOG data to disk.
+ */
+void
+XLogWalPropFlush(WalPropWriter * writer)
+{
+	XLogRecPtr	recptr = writer->bufStart;
+	char	   *buf = writer->buf;
+	Size		nbytes = writer->bufLen;
+	XLogSegNo	segno;
+	int			startoff;
+	int			byteswritten;
+
+	if (writer->bufLen == 0)
+		return;
+
+	XLByteToSeg(recptr, segno, wal_segment_size);
+
+	/* Close the current segment if the buffer is in another one */
+	if (writer->file >= 0 && segno != writer->segNo)
+		XLogWalPropClose(writer);
+
+	if (writer->file < 0)
+	{
+#if PG_VERSION_NUM < 150000
+		bool		use_existent = true;
 #endif
-			/* Create/use new log file */
-			XLByteToSeg(recptr, walpropSegNo, wal_segment_size);
+		/* Create/use new log file */
+		writer->segNo = segno;
 #if PG_VERSION_NUM >= 150000
-			walpropFile = XLogFileInit(walpropSegNo, tli);
-			walpropFileTLI = tli;
+		writer->file = XLogFileInit(writer->segNo, XLogWalPropTLI());
 #else
-			walpropFile = XLogFileInit(walpropSegNo, &use_existent, false);
-			walpropFileTLI = ThisTimeLineID;
+		writer->file = XLogFileInit(writer->segNo, &use_existent, false);
 #endif
-		}
-
-		/* Calculate the start offset of the received logs */
-		startoff = XLogSegmentOffset(recptr, wal_segment_size);
+		writer->fileTLI = XLogWalPropTLI();
+	}
 
-		if (startoff + nbytes > wal_segment_size)
-			segbytes = wal_segment_size - startoff;
-		else
-			segbytes = nbytes;
+	/* Calculate the start offset of the received logs */
+	startoff = XLogSegmentOffset(recptr, wal_segment_size);
 
+	while (nbytes > 0)
+	{
 		/* OK to write the logs */
 		errno = 0;
 
-		byteswritten = pg_pwrite(walpropFile, buf, segbytes, (off_t) startoff);
+		byteswritten = pg_pwrite(writer->file, buf, nbytes, (off_t) startoff);
 		if (byteswritten <= 0)
 		{
 			char		xlogfname[MAXFNAMELEN];
@@ -454,29 +556,74 @@ XLogWalPropWrite(char *buf, Size nbytes, XLogRecPtr recptr)
 				errno = ENOSPC;
 
 			save_errno = errno;
-			XLogFileName(xlogfname, walpropFileTLI, walpropSegNo, wal_segment_size);
+			XLogFileName(xlogfname, writer->fileTLI, writer->segNo, wal_segment_size);
 			errno = save_errno;
 			ereport(PANIC,
 					(errcode_for_file_access(),
 					 errmsg("could not write to log segment %s "
 							"at offset %u, length %lu: %m",
-							xlogfname, startoff, (unsigned long) segbytes)));
+							xlogfname, startoff, (unsigned long) nbytes)));
 		}
 
 		/* Update state for write */
 		recptr += byteswritten;
-
+		startoff += byteswritten;
 		nbytes -= byteswritten;
 		buf += byteswritten;
 	}
+	writer->bufLen = 0;
+
+	/* Prepare the next segment once we are past the middle of this one */
+	if (startoff >= wal_segment_size / 2 && writer->preallocSegNo <= segno)
+	{
+		XLogWalPropPreallocate(segno + 1);
+		writer->preallocSegNo = segno + 1;
+	}
 
 	/*
 	 * Close the current segment if it's fully written up in the last cycle of
 	 * the loop.
 	 */
-	if (walpropFile >= 0 && !XLByteInSeg(recptr, walpropSegNo, wal_segment_size))
+	if (!XLByteInSeg(recptr, writer->segNo, wal_segment_size))
 	{
-		XLogWalPropClose(recptr);
+		XLogWalPropClose(writer);
+	}
+}
+
+/*
+ * Write XLOG data to disk. The data is buffered, see XLogWalPropFlush.
+ */
+void
+XLogWalPropWrite(WalPropWriter * writer, char *buf, Size nbytes, XLogRecPtr recptr)
+{
+	if (writer->buf == NULL)
+		writer->buf = MemoryContextAlloc(TopMemoryContext, WALPROP_WRITE_BUF_SIZE);
+
+	while (nbytes > 0)
+	{
+		Size		segbytes;
+		Size		segleft;
+
+		/* The buffer must stay contiguous and within one segment */
+		if (writer->bufLen > 0 &&
+			(recptr != writer->bufStart + writer->bufLen ||
+			 XLogSegmentOffset(recptr, wal_segment_size) == 0))
+			XLogWalPropFlush(writer);
+
+		if (writer->bufLen == 0)
+			writer->bufStart = recptr;
+
+		segleft = wal_segment_size - XLogSegmentOffset(recptr, wal_segment_size);
+		segbytes = Min(nbytes, Min(segleft, WALPROP_WRITE_BUF_SIZE - writer->bufLen));
+
+		memcpy(writer->buf + writer->bufLen, buf, segbytes);
+		writer->bufLen += segbytes;
+		recptr += segbytes;
+		nbytes -= segbytes;
+		buf += segbytes;
+
+		if (writer->bufLen == WALPROP_WRITE_BUF_SIZE || segbytes == segleft)
+			XLogWalPropFlush(writer);
 	}
 }
 
@@ -484,15 +631,15 @@ XLogWalPropWrite(char *buf, Size nbytes, XLogRecPtr recptr)
  * Close the current segment.
  */
 void
-XLogWalPropClose(XLogRecPtr recptr)
+XLogWalPropClose(WalPropWriter * writer)
 {
-	Assert(walpropFile >= 0 && !XLByteInSeg(recptr, walpropSegNo, wal_segment_size));
+	Assert(writer->file >= 0);
 
-	if (close(walpropFile) != 0)
+	if (close(writer->file) != 0)
 	{
 		char		xlogfname[MAXFNAMELEN];
 
-		XLogFileName(xlogfname, walpropFileTLI, walpropSegNo, wal_segment_size);
+		XLogFileName(xlogfname, writer->fileTLI, writer->segNo, wal_segment_size);
 
 		ereport(PANIC,
 				(errcode_for_file_access(),
@@ -500,7 +647,23 @@ XLogWalPropClose(XLogRecPtr recptr)
 						xlogfname)));
 	}
 
-	walpropFile = -1;
+	writer->file = -1;
+}
+
+/*
+ * Write out the buffered XLOG data, close the segment and free the buffer.
+ */
+void
+XLogWalPropFinish(WalPropWriter * writer)
+{
+	XLogWalPropFlush(writer);
+	if (writer->file >= 0)
+		XLogWalPropClose(writer);
+	if (writer->buf != NULL)
+	{
+		pfree(writer->buf);
+		writer->buf = NULL;
+	}
 }
 
 /* START of cloned functions from walsender.c */
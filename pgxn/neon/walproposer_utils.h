@@ -3,6 +3,22 @@
 
 #include "walproposer.h"
 
+/*
+ * State of writing one range of WAL to disk during recovery. Each concurrent
+ * recovery stream has its own, so that they don't flush each other's buffers
+ * or close each other's segments.
+ */
+typedef struct WalPropWriter
+{
+	int			file;			/* open segment, or -1 */
+	TimeLineID	fileTLI;		/* TimeLineID in the file name */
+	XLogSegNo	segNo;			/* segment number of the file */
+	XLogSegNo	preallocSegNo;	/* last preallocated segment */
+	char	   *buf;
+	XLogRecPtr	bufStart;
+	Size		bufLen;
+}			WalPropWriter;
+
 int			CompareLsn(const void *a, const void *b);
 char	   *FormatSafekeeperState(SafekeeperState state);
 void		AssertEventsOkForState(uint32 events, Safekeeper *sk);
@@ -13,7 +29,10 @@ uint32		pq_getmsgint32_le(StringInfo msg);
 uint64		pq_getmsgint64_le(StringInfo msg);
 void		pq_sendint32_le(StringInfo buf, uint32 i);
 void		pq_sendint64_le(StringInfo buf, uint64 i);
-void		XLogWalPropWrite(char *buf, Size nbytes, XLogRecPtr recptr);
-void		XLogWalPropClose(XLogRecPtr recptr);
+void		XLogWalPropInit(WalPropWriter * writer);
+void		XLogWalPropWrite(WalPropWriter * writer, char *buf, Size nbytes, XLogRecPtr recptr);
+void		XLogWalPropFlush(WalPropWriter * writer);
+void		XLogWalPropClose(WalPropWriter * writer);
+void		XLogWalPropFinish(WalPropWriter * writer);
 
 #endif							/* __NEON_WALPROPOSER_UTILS_H__ */
@@ -28,6 +28,9 @@ use utils::{
 pub const SK_MAGIC: u32 = 0xcafeceefu32;
 pub const SK_FORMAT_VERSION: u32 = 7;
 const SK_PROTOCOL_VERSION: u32 = 2;
+/// Compression methods of the WAL in AppendRequest, negotiated in the greeting.
+pub const SK_COMPRESSION_NONE: u32 = 0;
+pub const SK_COMPRESSION_PGLZ: u32 = 1;
 pub const UNKNOWN_SERVER_VERSION: u32 = 0;
 
 /// Consensus logical timestamp.
@@ -278,6 +281,10 @@ pub struct ProposerGreeting {
     pub tenant_id: TenantId,
     pub tli: TimeLineID,
     pub wal_seg_size: u32,
+    /// Compression the proposer can use for AppendRequests. Older proposers
+    /// don't send it.
+    #[serde(skip)]
+    pub compression: u32,
 }
 
 /// Acceptor -> Proposer initial response: the highest term known to me
@@ -286,6 +293,9 @@ pub struct ProposerGreeting {
 pub struct AcceptorGreeting {
     term: u64,
     node_id: NodeId,
+    /// Compression accepted for AppendRequests; sent only if the proposer
+    /// asked for it, as older proposers don't expect it.
+    compression: u32,
 }
 
 /// Vote request sent from proposer to safekeepers
@@ -393,7 +403,10 @@ impl ProposerAcceptorMessage {
         let tag = stream.read_u64::<LittleEndian>()? as u8 as char;
         match tag {
             'g' => {
-                let msg = ProposerGreeting::des_from(&mut stream)?;
+                let mut msg = ProposerGreeting::des_from(&mut stream)?;
+                msg.compression = stream
+                    .read_u32::<LittleEndian>()
+                    .unwrap_or(SK_COMPRESSION_NONE);
                 Ok(ProposerAcceptorMessage::Greeting(msg))
             }
             'v' => {
@@ -442,11 +455,93 @@ impl ProposerAcceptorMessage {
 
                 Ok(ProposerAcceptorMessage::AppendRequest(msg))
             }
+            'z' => {
+                // AppendRequest with pglz compressed wal data, preceded by its size
+                let hdr = AppendRequestHeader::des_from(&mut stream)?;
+                let rec_size = hdr
+                    .end_lsn
+                    .checked_sub(hdr.begin_lsn)
+                    .context("begin_lsn > end_lsn in AppendRequest")?
+                    .0 as usize;
+                if rec_size > MAX_SEND_SIZE {
+                    bail!(
+                        "AppendRequest is longer than MAX_SEND_SIZE ({})",
+                        MAX_SEND_SIZE
+                    );
+                }
+                let compressed_size = stream.read_u32::<LittleEndian>()? as usize;
+                if compressed_size > rec_size + 4 {
+                    bail!("compressed AppendRequest is longer than its wal data");
+                }
+
+                let mut compressed: Vec<u8> = vec![0; compressed_size];
+                stream.read_exact(&mut compressed)?;
+                let wal_data = Bytes::from(pglz_decompress(&compressed, rec_size)?);
+                let msg = AppendRequest { h: hdr, wal_data };
+
+                Ok(ProposerAcceptorMessage::AppendRequest(msg))
+            }
             _ => bail!("unknown proposer-acceptor message tag: {}", tag,),
         }
     }
 }
 
+/// Decompress data compressed with Postgres pglz_compress(), which is known
+/// to decompress to exactly raw_size bytes.
+fn pglz_decompress(src: &[u8], raw_size: usize) -> Result<Vec<u8>> {
+    let mut dst: Vec<u8> = Vec::with_capacity(raw_size);
+    let mut sp = 0;
+
+    while sp < src.len() && dst.len() < raw_size {
+        // each control byte describes the next 8 items: literal bytes for
+        // clear bits, back references for set bits
+        let mut ctrl = src[sp];
+        sp += 1;
+        for _ in 0..8 {
+            if sp >= src.len() || dst.len() >= raw_size {
+                break;
+            }
+            if ctrl & 1 != 0 {
+                if sp + 2 > src.len() {
+                    bail!("compressed data is corrupt");
+                }
+                let mut len = (src[sp] & 0x0f) as usize + 3;
+                let off = (((src[sp] & 0xf0) as usize) << 4) | src[sp + 1] as usize;
+                sp += 2;
+                if len == 18 {
+                    if sp >= src.len() {
+                        bail!("compressed data is corrupt");
+                    }
+                    len += src[sp] as usize;
+                    sp += 1;
+                }
+                if off == 0 || off > dst.len() {
+                    bail!("compressed data is corrupt");
+                }
+                len = min(len, raw_size - dst.len());
+                // the reference can overlap the bytes being produced
+                let start = dst.len() - off;
+                for i in 0..len {
+                    dst.push(dst[start + i]);
+                }
+            } else {
+                dst.push(src[sp]);
+                sp += 1;
+            }
+            ctrl >>= 1;
+        }
+    }
+
+    if dst.len() != raw_size || sp != src.len() {
+        bail!(
+            "compressed data is corrupt: decompressed {} of {} bytes",
+            dst.len(),
+            raw_size
+        );
+    }
+    Ok(dst)
+}
+
 /// Acceptor -> Proposer messages
 #[derive(Debug)]
 pub enum AcceptorProposerMessage {
@@ -463,6 +558,9 @@ impl AcceptorProposerMessage {
                 buf.put_u64_le('g' as u64);
                 buf.put_u64_le(msg.term);
                 buf.put_u64_le(msg.node_id.0);
+                if msg.compression != SK_COMPRESSION_NONE {
+                    buf.put_u32_le(msg.compression);
+                }
             }
             AcceptorProposerMessage::VoteResponse(msg) => {
                 buf.put_u64_le('v' as u64);
@@ -656,9 +754,16 @@ where
             "processed greeting from proposer {:?}, sending term {:?}",
             msg.proposer_id, self.state.acceptor_state.term
         );
+        // pglz is the only compression we support
+        let compression = if msg.compression == SK_COMPRESSION_PGLZ {
+            SK_COMPRESSION_PGLZ
+        } else {
+            SK_COMPRESSION_NONE
+        };
         Ok(Some(AcceptorProposerMessage::Greeting(AcceptorGreeting {
             term: self.state.acceptor_state.term,
             node_id: self.node_id,
+            compression,
         })))
     }
 
@@ -1104,4 +1209,23 @@ mod tests {
         sk.wal_store.truncate_wal(Lsn(3)).unwrap(); // imitate the complete record at 3 %)
         assert_eq!(sk.get_epoch(), 1);
     }
+
+    #[test]
+    fn test_pglz_decompress() {
+        // "abc" as literals, then a back reference of 9 bytes at offset 3,
+        // and a literal "X"
+        let compressed = [0x08, b'a', b'b', b'c', 0x06, 0x03, b'X'];
+        assert_eq!(
+            pglz_decompress(&compressed, 13).unwrap(),
+            b"abcabcabcabcX".to_vec()
+        );
+
+        // a reference with the extra length byte: 18 + 2 bytes at offset 1
+        let compressed = [0x02, b'a', 0x0f, 0x01, 0x02];
+        assert_eq!(pglz_decompress(&compressed, 21).unwrap(), vec![b'a'; 21]);
+
+        // wrong size and references before the start of the data
+        assert!(pglz_decompress(&[0x08, b'a', b'b', b'c', 0x06, 0x03, b'X'], 14).is_err());
+        assert!(pglz_decompress(&[0x01, 0x00, 0x05], 3).is_err());
+    }
 }
@@ -0,0 +1,268 @@
+"""
+A stand-in safekeeper for walproposer benchmarks.
+
+MockSafekeeper speaks just enough of the postgres wire protocol and of the
+proposer-safekeeper protocol (see pgxn/neon/walproposer.h) to let a compute
+elect itself and stream WAL to it: greeting, vote, elected, append requests
+and append responses with pageserver feedback. WAL is counted and thrown away,
+and every append is acknowledged after a configurable latency plus random
+jitter, so that the walproposer can be measured without the cost and noise of
+real safekeepers.
+
+The mock does not keep WAL, so it can't serve as a recovery donor: start each
+compute against fresh mocks.
+"""
+
+import asyncio
+import random
+import struct
+import threading
+import time
+from typing import List, Optional, Tuple
+
+from fixtures.log_helper import log
+
+SSL_REQUEST_CODE = 80877103
+GSSENC_REQUEST_CODE = 80877104
+PROTOCOL_VERSION_3 = 196608
+
+# Postgres timestamps count microseconds since 2000-01-01
+PG_EPOCH_OFFSET = 946684800
+
+# Fixed part of AppendRequestHeader: tag, term, epochStartLsn, beginLsn,
+# endLsn, commitLsn, truncateLsn and proposerId
+APPEND_REQUEST_HEADER = struct.Struct("<QQQQQQQ16s")
+
+
+def pg_message(msg_type: bytes, payload: bytes = b"") -> bytes:
+    return msg_type + struct.pack(">i", len(payload) + 4) + payload
+
+
+def pg_now() -> int:
+    return int((time.time() - PG_EPOCH_OFFSET) * 1_000_000)
+
+
+class MockSafekeeper:
+    """
+    Accepts walproposer connections on the given port. Each acknowledgement is
+    delayed by ack_latency_ms plus a uniformly distributed 0..jitter_ms, but
+    acknowledgements are never reordered.
+    """
+
+    def __init__(
+        self, port: int, node_id: int = 1, ack_latency_ms: float = 0, jitter_ms: float = 0
+    ):
+        self.port = port
+        self.node_id = node_id
+        self.ack_latency_ms = ack_latency_ms
+        self.jitter_ms = jitter_ms
+
+        # Persistent acceptor state, shared by all connections
+        self.term = 0
+        self.term_history: List[Tuple[int, int]] = []
+        self.timeline_start_lsn = 0
+        self.flush_lsn = 0
+        self.commit_lsn = 0
+        self.truncate_lsn = 0
+
+        self.appends_received = 0
+        self.bytes_received = 0
+
+        self.loop: Optional[asyncio.AbstractEventLoop] = None
+        self.server: Optional[asyncio.AbstractServer] = None
+        self.thread: Optional[threading.Thread] = None
+
+    def start(self) -> "MockSafekeeper":
+        started = threading.Event()
+
+        def run():
+            self.loop = asyncio.new_event_loop()
+            asyncio.set_event_loop(self.loop)
+            self.server = self.loop.run_until_complete(
+                asyncio.start_server(self.handle_connection, "localhost", self.port)
+            )
+            started.set()
+            self.loop.run_forever()
+            self.server.close()
+            self.loop.run_until_complete(self.server.wait_closed())
+            self.loop.close()
+
+        self.thread = threading.Thread(target=run, name=f"mock_safekeeper_{self.port}", daemon=True)
+        self.thread.start()
+        started.wait()
+        log.info(f"mock safekeeper {self.node_id} listening on port {self.port}")
+        return self
+
+    def stop(self):
+        if self.loop is not None and self.thread is not None:
+            self.loop.call_soon_threadsafe(self.loop.stop)
+            self.thread.join()
+            self.thread = None
+
+    def __enter__(self) -> "MockSafekeeper":
+        return self.start()
+
+    def __exit__(self, exc_type, exc, tb):
+        self.stop()
+
+    def ack_delay(self) -> float:
+        return (self.ack_latency_ms + random.uniform(0, self.jitter_ms)) / 1000
+
+    async def handle_connection(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter):
+        acks: asyncio.Queue = asyncio.Queue()
+        sender = asyncio.ensure_future(self.send_acks(acks, writer))
+        try:
+            if await self.handle_startup(reader, writer):
+                await self.handle_messages(reader, writer, acks)
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            sender.cancel()
+            writer.close()
+
+    async def send_acks(self, acks: asyncio.Queue, writer: asyncio.StreamWriter):
+        """
+        Write queued acknowledgements once they are due, in queue order.
+        """
+        while True:
+            due, msg = await acks.get()
+            delay = due - asyncio.get_event_loop().time()
+            if delay > 0:
+                await asyncio.sleep(delay)
+            writer.write(pg_message(b"d", msg))
+            await writer.drain()
+
+    async def handle_startup(
+        self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter
+    ) -> bool:
+        while True:
+            (length,) = struct.unpack(">i", await reader.readexactly(4))
+            packet = await reader.readexactly(length - 4)
+            (code,) = struct.unpack_from(">i", packet)
+            if code in (SSL_REQUEST_CODE, GSSENC_REQUEST_CODE):
+                # Encryption is not supported, libpq falls back to plain text
+                writer.write(b"N")
+                continue
+            if code != PROTOCOL_VERSION_3:
+                return False
+            break
+
+        writer.write(pg_message(b"R", struct.pack(">i", 0)))
+        for name, value in [
+            ("server_version", "15.0"),
+            ("client_encoding", "UTF8"),
+            ("standard_conforming_strings", "on"),
+            ("integer_datetimes", "on"),
+        ]:
+            writer.write(pg_message(b"S", name.encode() + b"\0" + value.encode() + b"\0"))
+        writer.write(pg_message(b"K", struct.pack(">ii", self.port, self.node_id)))
+        writer.write(pg_message(b"Z", b"I"))
+        await writer.drain()
+        return True
+
+    async def handle_messages(
+        self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter, acks: asyncio.Queue
+    ):
+        while True:
+            msg_type = await reader.readexactly(1)
+            (length,) = struct.unpack(">i", await reader.readexactly(4))
+            payload = await reader.readexactly(length - 4)
+
+            if msg_type == b"Q":
+                query = payload.rstrip(b"\0").decode()
+                if query != "START_WAL_PUSH":
+                    error = f"unsupported query: {query}".encode()
+                    writer.write(pg_message(b"E", b"SERROR\0C0A000\0M" + error + b"\0\0"))
+                    writer.write(pg_message(b"Z", b"I"))
+                else:
+                    # CopyBothResponse, textual format, no columns
+                    writer.write(pg_message(b"W", struct.pack(">bh", 0, 0)))
+                await writer.drain()
+            elif msg_type == b"d":
+                reply = self.handle_proposer_message(payload)
+                if reply is not None:
+                    delay = self.ack_delay() if payload[0:1] == b"a" else 0
+                    await acks.put((asyncio.get_event_loop().time() + delay, reply))
+            elif msg_type in (b"c", b"X"):
+                return
+
+    def handle_proposer_message(self, msg: bytes) -> Optional[bytes]:
+        tag = chr(struct.unpack_from("<Q", msg)[0])
+
+        if tag == "g":
+            return struct.pack("<QQQ", ord("g"), self.term, self.node_id)
+
+        if tag == "v":
+            _, term, _ = struct.unpack_from("<QQ16s", msg)
+            vote_given = term > self.term
+            if vote_given:
+                self.term = term
+            reply = struct.pack(
+                "<QQQQQI",
+                ord("v"),
+                self.term,
+                int(vote_given),
+                self.flush_lsn,
+                self.truncate_lsn,
+                len(self.term_history),
+            )
+            for entry in self.term_history:
+                reply += struct.pack("<QQ", *entry)
+            return reply + struct.pack("<Q", self.timeline_start_lsn)
+
+        if tag == "e":
+            _, term, start_streaming_at, n_entries = struct.unpack_from("<QQQI", msg)
+            offset = 28
+            history: List[Tuple[int, int]] = []
+            for _ in range(n_entries):
+                entry_term, entry_lsn = struct.unpack_from("<QQ", msg, offset)
+                history.append((entry_term, entry_lsn))
+                offset += 16
+            (self.timeline_start_lsn,) = struct.unpack_from("<Q", msg, offset)
+            self.term = term
+            self.term_history = history
+            self.flush_lsn = start_streaming_at
+            log.info(
+                f"mock safekeeper {self.node_id}: proposer elected in term {term}, "
+                f"streaming from {start_streaming_at:X}"
+            )
+            return None
+
+        if tag == "a":
+            (
+                _,
+                term,
+                _,
+                begin_lsn,
+                end_lsn,
+                commit_lsn,
+                truncate_lsn,
+                _,
+            ) = APPEND_REQUEST_HEADER.unpack_from(msg)
+            self.appends_received += 1
+            self.bytes_received += end_lsn - begin_lsn
+            if term == self.term:
+                self.flush_lsn = max(self.flush_lsn, end_lsn)
+                self.commit_lsn = max(self.commit_lsn, min(commit_lsn, self.flush_lsn))
+                self.truncate_lsn = max(self.truncate_lsn, truncate_lsn)
+            return self.append_response()
+
+        log.warning(f"mock safekeeper {self.node_id}: unexpected message tag {tag!r}")
+        return None
+
+    def append_response(self) -> bytes:
+        reply = struct.pack(
+            "<QQQQQQQ", ord("a"), self.term, self.flush_lsn, self.commit_lsn, 0, 0, 0
+        )
+
+        # Pretend the pageserver has caught up, so that backpressure stays idle
+        feedback = [
+            ("ps_writelsn", self.flush_lsn),
+            ("ps_flushlsn", self.flush_lsn),
+            ("ps_applylsn", self.flush_lsn),
+            ("ps_replytime", pg_now()),
+        ]
+        reply += struct.pack("<B", len(feedback))
+        for key, value in feedback:
+            reply += key.encode() + b"\0" + struct.pack(">iq", 8, value)
+        return reply
@@ -1,5 +1,6 @@
 from contextlib import closing
 
+from fixtures.benchmark_fixture import MetricReport
 from fixtures.compare_fixtures import PgCompare
 
 
@@ -28,5 +29,42 @@ def test_gist_buffering_build(neon_with_baseline: PgCompare):
                     )
                     env.flush()
 
+            cur.execute("select pg_relation_size('gist_pointidx2')")
+            env.zenbenchmark.record(
+                "index_size", cur.fetchone()[0], "bytes", MetricReport.LOWER_IS_BETTER
+            )
+
+            env.report_peak_memory_use()
+            env.report_size()
+
+
+#
+# Test SP-GiST build. Like the buffering GiST build, it populates the index
+# without WAL-logging, and then WAL-logs the whole relation at the end, so
+# the build time includes reading back the local copy of the index.
+#
+def test_spgist_build(neon_with_baseline: PgCompare):
+    env = neon_with_baseline
+
+    with closing(env.pg.connect()) as conn:
+        with conn.cursor() as cur:
+
+            # Create test table.
+            cur.execute("create table spgist_point_tbl(id int4, p point)")
+            cur.execute(
+                "insert into spgist_point_tbl select g, point(g, g) from generate_series(1, 1000000) g;"
+            )
+
+            # Build the index.
+            with env.record_pageserver_writes("pageserver_writes"):
+                with env.record_duration("build"):
+                    cur.execute("create index spgist_pointidx on spgist_point_tbl using spgist(p)")
+                    env.flush()
+
+            cur.execute("select pg_relation_size('spgist_pointidx')")
+            env.zenbenchmark.record(
+                "index_size", cur.fetchone()[0], "bytes", MetricReport.LOWER_IS_BETTER
+            )
+
             env.report_peak_memory_use()
             env.report_size()
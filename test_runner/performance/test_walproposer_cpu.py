@@ -0,0 +1,53 @@
+import os
+from contextlib import closing
+
+from fixtures.benchmark_fixture import MetricReport, NeonBenchmarker
+from fixtures.log_helper import log
+from fixtures.neon_fixtures import NeonEnvBuilder
+
+
+def get_process_cpu_time(pid: int) -> float:
+    """
+    Return the user + system CPU time consumed by the process, in seconds.
+    """
+    with open(f"/proc/{pid}/stat") as f:
+        # The command name in parentheses may contain spaces, so split after it
+        fields = f.read().rsplit(")", 1)[1].split()
+    # utime and stime are the 14th and 15th fields, counting the pid and comm
+    utime, stime = int(fields[11]), int(fields[12])
+    return (utime + stime) / os.sysconf("SC_CLK_TCK")
+
+
+#
+# Measure the CPU used by the walproposer per commit, with small transactions
+# committed one by one to three safekeepers.
+#
+def test_walproposer_cpu_per_commit(
+    neon_env_builder: NeonEnvBuilder, zenbenchmark: NeonBenchmarker
+):
+    neon_env_builder.num_safekeepers = 3
+    env = neon_env_builder.init_start()
+
+    env.neon_cli.create_branch("test_walproposer_cpu_per_commit")
+    pg = env.postgres.create_start("test_walproposer_cpu_per_commit")
+
+    n_commits = 20000
+    with closing(pg.connect()) as conn:
+        with conn.cursor() as cur:
+            cur.execute("SELECT pid FROM pg_stat_activity WHERE backend_type = 'WAL proposer'")
+            walproposer_pid = cur.fetchone()[0]
+            cur.execute("CREATE TABLE t (i integer)")
+
+            cpu_before = get_process_cpu_time(walproposer_pid)
+            with zenbenchmark.record_duration("run"):
+                for i in range(n_commits):
+                    cur.execute("INSERT INTO t VALUES (%s)", (i,))
+            cpu_used = get_process_cpu_time(walproposer_pid) - cpu_before
+
+    log.info(f"walproposer used {cpu_used} s of CPU for {n_commits} commits")
+    zenbenchmark.record(
+        "walproposer_cpu_per_commit",
+        cpu_used * 1_000_000 / n_commits,
+        "us",
+        MetricReport.LOWER_IS_BETTER,
+    )
@@ -0,0 +1,115 @@
+import statistics
+import time
+from contextlib import ExitStack, closing
+
+import pytest
+from fixtures.benchmark_fixture import MetricReport, NeonBenchmarker
+from fixtures.log_helper import log
+from fixtures.mock_safekeeper import MockSafekeeper
+from fixtures.neon_fixtures import NeonEnvBuilder, PortDistributor
+from performance.test_walproposer_cpu import get_process_cpu_time
+
+
+#
+# Benchmark the walproposer alone: stream WAL to three mock safekeepers which
+# acknowledge appends after the given latency and jitter, and measure commit
+# latency, throughput and walproposer CPU per MB of WAL.
+#
+# The pageserver never receives this WAL, so the workload only emits logical
+# messages and never reads pages.
+#
+@pytest.mark.parametrize("ack_latency_ms, jitter_ms", [(0, 0), (1, 0), (5, 2)])
+def test_walproposer_mock(
+    neon_env_builder: NeonEnvBuilder,
+    zenbenchmark: NeonBenchmarker,
+    port_distributor: PortDistributor,
+    ack_latency_ms: float,
+    jitter_ms: float,
+):
+    neon_env_builder.num_safekeepers = 0
+    env = neon_env_builder.init_start()
+    env.neon_cli.create_branch("test_walproposer_mock")
+
+    with ExitStack() as stack:
+        mocks = [
+            stack.enter_context(
+                MockSafekeeper(
+                    port_distributor.get_port(),
+                    node_id=i + 1,
+                    ack_latency_ms=ack_latency_ms,
+                    jitter_ms=jitter_ms,
+                )
+            )
+            for i in range(3)
+        ]
+        safekeepers = ",".join(f"localhost:{sk.port}" for sk in mocks)
+        pg = env.postgres.create_start(
+            "test_walproposer_mock",
+            config_lines=[
+                f"neon.safekeepers='{safekeepers}'",
+                "synchronous_standby_names=walproposer",
+                "synchronous_commit=on",
+            ],
+        )
+
+        with closing(pg.connect()) as conn:
+            with conn.cursor() as cur:
+                cur.execute("SELECT pid FROM pg_stat_activity WHERE backend_type = 'WAL proposer'")
+                walproposer_pid = cur.fetchone()[0]
+
+                # Commit latency of small transactions
+                n_commits = 2000
+                latencies = []
+                for _ in range(n_commits):
+                    started = time.monotonic()
+                    cur.execute("SELECT pg_logical_emit_message(true, 'bench', repeat('x', 100))")
+                    latencies.append((time.monotonic() - started) * 1000)
+
+                latencies.sort()
+                zenbenchmark.record(
+                    "commit_latency_p50",
+                    statistics.median(latencies),
+                    "ms",
+                    MetricReport.LOWER_IS_BETTER,
+                )
+                zenbenchmark.record(
+                    "commit_latency_p99",
+                    latencies[int(len(latencies) * 0.99) - 1],
+                    "ms",
+                    MetricReport.LOWER_IS_BETTER,
+                )
+                zenbenchmark.record(
+                    "commits_per_second",
+                    n_commits / (sum(latencies) / 1000),
+                    "",
+                    MetricReport.HIGHER_IS_BETTER,
+                )
+
+                # Throughput of large transactions
+                n_messages = 256
+                cur.execute("SELECT pg_current_wal_flush_lsn()")
+                start_lsn = cur.fetchone()[0]
+                cpu_before = get_process_cpu_time(walproposer_pid)
+                started = time.monotonic()
+                for _ in range(n_messages):
+                    cur.execute(
+                        "SELECT pg_logical_emit_message(true, 'bench', repeat('x', 256 * 1024))"
+                    )
+                elapsed = time.monotonic() - started
+                cpu_used = get_process_cpu_time(walproposer_pid) - cpu_before
+                cur.execute("SELECT pg_wal_lsn_diff(pg_current_wal_flush_lsn(), %s)", (start_lsn,))
+                wal_mb = float(cur.fetchone()[0]) / (1024 * 1024)
+
+        log.info(
+            f"streamed {wal_mb:.1f} MB in {elapsed:.2f} s using {cpu_used:.2f} s of CPU, "
+            f"mock safekeepers received {[sk.bytes_received for sk in mocks]} bytes"
+        )
+        zenbenchmark.record("throughput", wal_mb / elapsed, "MB/s", MetricReport.HIGHER_IS_BETTER)
+        zenbenchmark.record(
+            "walproposer_cpu_per_mb",
+            cpu_used * 1000 / wal_mb,
+            "ms",
+            MetricReport.LOWER_IS_BETTER,
+        )
+
+        pg.stop()
@@ -6,6 +6,7 @@ import psycopg2.extras
 import pytest
 from fixtures.log_helper import log
 from fixtures.neon_fixtures import NeonEnvBuilder, Postgres
+from fixtures.utils import wait_until
 
 pytest_plugins = "fixtures.neon_fixtures"
 
@@ -164,3 +165,80 @@ def test_backpressure_received_lsn_lag(neon_env_builder: NeonEnvBuilder):
 
 # TODO test_backpressure_disk_consistent_lsn_lag. Play with pageserver's checkpoint settings
 # TODO test_backpressure_remote_consistent_lsn_lag
+
+
+# Check that with neon.backpressure_fair, a backend that only writes a little
+# WAL isn't held behind a bulk load that has built up the lag.
+def test_backpressure_fair(neon_env_builder: NeonEnvBuilder):
+    env = neon_env_builder.init_start()
+    env.neon_cli.create_branch("test_backpressure_fair")
+    pg = env.postgres.create_start(
+        "test_backpressure_fair",
+        config_lines=["max_replication_write_lag=5MB", "neon.backpressure_fair=on"],
+    )
+    pageserver_http = env.pageserver.http_client()
+
+    # Connect and warm up the caches before the lag builds up, as the page
+    # server won't be able to serve pages at the latest LSN then.
+    light_conn = pg.connect()
+    light_cur = light_conn.cursor()
+    light_cur.execute("CREATE EXTENSION neon")
+    light_cur.execute("CREATE TABLE light (x bigint)")
+    light_cur.execute("CREATE TABLE heavy (x bigint, t text)")
+    light_cur.execute("INSERT INTO light VALUES (0)")
+    heavy_conn = pg.connect()
+    heavy_cur = heavy_conn.cursor()
+    heavy_cur.execute("INSERT INTO heavy VALUES (0, '')")
+
+    stop_event = threading.Event()
+
+    def heavy_writer():
+        while not stop_event.is_set():
+            try:
+                heavy_cur.execute(
+                    "INSERT INTO heavy SELECT g, repeat('x', 100) FROM generate_series(1, 100000) g"
+                )
+            except Exception as e:
+                log.info(f"heavy writer failed: {e}")
+                return
+
+    def light_insert_latency() -> float:
+        started = time.monotonic()
+        light_cur.execute("INSERT INTO light VALUES (1)")
+        return time.monotonic() - started
+
+    pageserver_http.configure_failpoints(("walreceiver-after-ingest", "sleep(20)"))
+    heavy_thread = threading.Thread(target=heavy_writer)
+    heavy_thread.start()
+    try:
+        def heavy_throttled():
+            light_cur.execute(
+                "SELECT write_lag_throttles + flush_lag_throttles + apply_lag_throttles "
+                "FROM backpressure_throttling_stats()"
+            )
+            assert light_cur.fetchone()[0] > 0
+
+        wait_until(60, 0.5, heavy_throttled)
+
+        fair_latencies = sorted(light_insert_latency() for _ in range(20))
+        fair_median = fair_latencies[len(fair_latencies) // 2]
+        log.info(f"light writer latencies with fair backpressure: {fair_latencies}")
+
+        # Without fairness, the light writer is held until the lag goes under
+        # the limit, which only happens once the page server speeds up again.
+        pg.config(["neon.backpressure_fair=off"])
+        light_cur.execute("SELECT pg_reload_conf()")
+        time.sleep(1)
+        release = threading.Timer(
+            5, pageserver_http.configure_failpoints, (("walreceiver-after-ingest", "off"),)
+        )
+        release.start()
+        unfair_latency = light_insert_latency()
+        release.join()
+        log.info(f"light writer latency without fair backpressure: {unfair_latency}")
+
+        assert fair_median * 10 < unfair_latency
+    finally:
+        stop_event.set()
+        pageserver_http.configure_failpoints(("walreceiver-after-ingest", "off"))
+        heavy_thread.join()
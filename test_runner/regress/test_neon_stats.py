@@ -0,0 +1,346 @@
+import psycopg2.errors
+import pytest
+from fixtures.log_helper import log
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.utils import wait_until
+
+
+#
+# Test that requests to the page server are accounted in neon_smgr_stats().
+#
+def test_neon_smgr_stats(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_neon_smgr_stats", "empty")
+    pg = env.postgres.create_start("test_neon_smgr_stats")
+
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE EXTENSION neon_test_utils")
+
+    cur.execute("CREATE TABLE foo (id integer, t text)")
+    cur.execute(
+        "INSERT INTO foo SELECT g, 'long string to consume some space' FROM generate_series(1, 10000) g"
+    )
+
+    def get_page_stats():
+        cur.execute(
+            """
+            SELECT requests, bytes_received, latency_histogram
+            FROM neon_smgr_stats() WHERE request_type = 'get_page'
+            """
+        )
+        return cur.fetchone()
+
+    requests_before, bytes_before, _ = get_page_stats()
+
+    # Clear the buffer cache, to force the pages to be re-fetched from the
+    # page server
+    cur.execute("SELECT clear_buffer_cache()")
+    cur.execute("SELECT count(*) FROM foo")
+    assert cur.fetchone() == (10000,)
+
+    requests_after, bytes_after, histogram = get_page_stats()
+    log.info(f"get_page requests: {requests_before} -> {requests_after}, histogram: {histogram}")
+
+    assert requests_after > requests_before
+    assert bytes_after - bytes_before >= (requests_after - requests_before) * 8192
+    # Other backends may be recording requests concurrently, so the histogram
+    # can lag behind the request count but never exceed it
+    assert requests_before < sum(histogram) <= requests_after
+
+    cur.execute("SELECT requests FROM neon_smgr_stats() WHERE request_type = 'connect'")
+    assert cur.fetchone()[0] >= 1
+
+
+#
+# Test that neon_backend_wait_events() lists the backends.
+#
+def test_neon_backend_wait_events(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_neon_backend_wait_events", "empty")
+    pg = env.postgres.create_start("test_neon_backend_wait_events")
+
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+
+    cur.execute("CREATE EXTENSION neon")
+
+    # Our own backend is running the query, so it's not waiting.
+    cur.execute(
+        """
+        SELECT wait_event_type, wait_event
+        FROM neon_backend_wait_events() WHERE pid = pg_backend_pid()
+        """
+    )
+    assert cur.fetchone() == (None, None)
+
+    # The set of backends should match pg_stat_activity
+    cur.execute(
+        """
+        SELECT count(*) FROM neon_backend_wait_events() w
+        FULL JOIN pg_stat_activity a ON a.pid = w.pid
+        WHERE a.pid IS NULL OR w.pid IS NULL
+        """
+    )
+    assert cur.fetchone()[0] == 0
+
+    # Other users' wait events are only visible to members of pg_monitor
+    cur.execute("CREATE ROLE waiter")
+    cur.execute("SET ROLE waiter")
+    with pytest.raises(psycopg2.errors.InsufficientPrivilege):
+        cur.execute("SELECT count(*) FROM neon_backend_wait_events()")
+    cur.execute("RESET ROLE")
+    cur.execute("GRANT pg_monitor TO waiter")
+    cur.execute("SET ROLE waiter")
+    cur.execute("SELECT count(*) FROM neon_backend_wait_events()")
+    assert cur.fetchone()[0] > 0
+
+
+#
+# Test that EXPLAIN (ANALYZE, BUFFERS) reports the page server I/O of the
+# query with neon.explain_pageserver_io.
+#
+def test_explain_pageserver_io(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_explain_pageserver_io", "empty")
+    pg = env.postgres.create_start("test_explain_pageserver_io")
+
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE foo (id integer, t text)")
+    cur.execute(
+        "INSERT INTO foo SELECT g, 'long string to consume some space' FROM generate_series(1, 10000) g"
+    )
+
+    def explain_io():
+        cur.execute("SELECT clear_buffer_cache()")
+        cur.execute("EXPLAIN (ANALYZE, BUFFERS) SELECT count(*) FROM foo")
+        lines = [row[0] for row in cur.fetchall()]
+        return [line for line in lines if line.startswith("Pageserver I/O:")]
+
+    # Off by default
+    assert explain_io() == []
+
+    cur.execute("SET neon.explain_pageserver_io = on")
+    io_lines = explain_io()
+    log.info(f"{io_lines}")
+    assert len(io_lines) == 1
+
+    fields = dict(f.split("=") for f in io_lines[0].split(":", 1)[1].split() if "=" in f)
+    assert int(fields["getpage"]) > 0
+
+
+#
+# Test that page server reads are accounted to the statement that made them
+# in neon_stat_statements.
+#
+def test_neon_stat_statements(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_neon_stat_statements", "empty")
+    pg = env.postgres.create_start(
+        "test_neon_stat_statements", config_lines=["compute_query_id=on"]
+    )
+
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE foo (id integer, t text)")
+    cur.execute(
+        "INSERT INTO foo SELECT g, 'long string to consume some space' FROM generate_series(1, 10000) g"
+    )
+
+    cur.execute("SELECT neon_stat_statements_reset()")
+    cur.execute("SELECT clear_buffer_cache()")
+    cur.execute("SELECT count(*) FROM foo")
+    assert cur.fetchone() == (10000,)
+
+    cur.execute(
+        """
+        SELECT queryid, getpage_requests, bytes_received
+        FROM neon_stat_statements WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+        ORDER BY getpage_requests DESC LIMIT 1
+        """
+    )
+    queryid, getpage_requests, bytes_received = cur.fetchone()
+    log.info(f"query {queryid}: {getpage_requests} getpage requests, {bytes_received} bytes")
+
+    assert queryid is not None
+    assert getpage_requests > 0
+    assert bytes_received == getpage_requests * 8192
+
+    # With more statements than neon.stat_statements_max, the least used ones
+    # are evicted
+    pg.stop()
+    pg.config(["neon.stat_statements_max=10"])
+    pg.start()
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+    for i in range(30):
+        cur.execute(f"CREATE TABLE bar{i} AS SELECT * FROM foo LIMIT 100")
+    for i in range(30):
+        cur.execute("SELECT clear_buffer_cache()")
+        cur.execute(f"SELECT count(*) FROM bar{i}")
+    cur.execute("SELECT count(*) FROM neon_stat_statements")
+    n_statements = cur.fetchone()[0]
+    log.info(f"{n_statements} statements tracked")
+    assert 0 < n_statements <= 10
+
+
+#
+# Test that requests to the page server show up in neon_request_trace().
+#
+def test_neon_request_trace(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_neon_request_trace", "empty")
+    pg = env.postgres.create_start("test_neon_request_trace")
+
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE foo (id integer, t text)")
+    cur.execute("INSERT INTO foo SELECT g, 'x' FROM generate_series(1, 1000) g")
+    cur.execute("SELECT pg_relation_filenode('foo')")
+    relnode = cur.fetchone()[0]
+
+    cur.execute("SELECT clear_buffer_cache()")
+    cur.execute("SELECT count(*) FROM foo")
+
+    cur.execute(
+        """
+        SELECT blkno, latency_us, response FROM neon_request_trace()
+        WHERE pid = pg_backend_pid() AND relnode = %s AND request = 'NeonGetPageRequest'
+        ORDER BY seq
+        """,
+        (relnode,),
+    )
+    rows = cur.fetchall()
+    log.info(f"traced requests: {rows}")
+
+    assert len(rows) > 0
+    assert all(response == "NeonGetPageResponse" for _, _, response in rows)
+    assert 0 in [blkno for blkno, _, _ in rows]
+
+    # Other users' requests are only visible to members of pg_monitor
+    cur.execute("CREATE ROLE tracer")
+    cur.execute("SET ROLE tracer")
+    with pytest.raises(psycopg2.errors.InsufficientPrivilege):
+        cur.execute("SELECT count(*) FROM neon_request_trace()")
+    cur.execute("RESET ROLE")
+    cur.execute("GRANT pg_monitor TO tracer")
+    cur.execute("SET ROLE tracer")
+    cur.execute("SELECT count(*) FROM neon_request_trace()")
+    assert cur.fetchone()[0] > 0
+
+
+#
+# Test that the page server lag is sampled in backpressure_lag_history(), and
+# that backpressure_throttling_stats() is consistent.
+#
+def test_backpressure_stats(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_backpressure_stats", "empty")
+    pg = env.postgres.create_start("test_backpressure_stats")
+
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE TABLE foo (id integer, t text)")
+    cur.execute("INSERT INTO foo SELECT g, 'x' FROM generate_series(1, 10000) g")
+
+    def lag_sampled():
+        cur.execute(
+            "SELECT count(*), min(write_lag), min(flush_lag) FROM backpressure_lag_history()"
+        )
+        samples, write_lag, flush_lag = cur.fetchone()
+        log.info(f"{samples} lag samples, write_lag {write_lag}, flush_lag {flush_lag}")
+        assert samples > 0
+        assert write_lag is not None and write_lag >= 0
+
+    wait_until(20, 0.5, lag_sampled)
+
+    cur.execute("SELECT * FROM backpressure_throttling_stats()")
+    write_throttles, flush_throttles, apply_throttles, histogram = cur.fetchone()
+    assert len(histogram) == 16
+    assert sum(histogram) == write_throttles + flush_throttles + apply_throttles
+
+
+#
+# Test the bookkeeping of the cache of force-logged VM and FSM pages: pages
+# are evicted when it's full, forgotten when their relation is dropped, and
+# the cache is not used at all when it's disabled.
+#
+def test_wallog_cache(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_wallog_cache", "empty")
+    pg = env.postgres.create_start(
+        "test_wallog_cache",
+        # Nothing but the checkpoints below should write out VM or FSM pages
+        config_lines=["autovacuum=off", "bgwriter_lru_maxpages=0"],
+    )
+
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+    cur.execute("CREATE EXTENSION neon")
+
+    def get_stats():
+        cur.execute("SELECT entries, hits, misses, evictions FROM neon_wallog_cache_stats()")
+        return cur.fetchone()
+
+    # VACUUM creates the VM and FSM of the table, and the checkpoint logs them
+    cur.execute("CHECKPOINT")
+    cur.execute("CREATE TABLE foo (id integer, t text)")
+    cur.execute("INSERT INTO foo SELECT g, 'payload' FROM generate_series(1, 10000) g")
+    cur.execute("VACUUM foo")
+    cur.execute("CHECKPOINT")
+    entries_before, _, misses, _ = get_stats()
+    log.info(f"{entries_before} pages cached after {misses} misses")
+    assert entries_before > 0
+
+    cur.execute("DROP TABLE foo")
+    entries_after, _, _, _ = get_stats()
+    log.info(f"{entries_after} pages cached after DROP TABLE")
+    assert entries_after < entries_before
+
+    # With a tiny cache, pages are evicted to make room for new ones
+    pg.stop()
+    pg.config(["neon.wallog_cache_size=2"])
+    pg.start()
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+    for i in range(5):
+        cur.execute(f"CREATE TABLE foo{i} (id integer, t text)")
+        cur.execute(f"INSERT INTO foo{i} SELECT g, 'payload' FROM generate_series(1, 1000) g")
+        cur.execute(f"VACUUM foo{i}")
+    cur.execute("CHECKPOINT")
+    entries, _, misses, evictions = get_stats()
+    log.info(f"{entries} pages cached after {misses} misses and {evictions} evictions")
+    assert entries <= 2
+    assert evictions > 0
+
+    # With the cache disabled, pages are logged without looking them up
+    pg.stop()
+    pg.config(["neon.wallog_cache_size=0"])
+    pg.start()
+    pg_conn = pg.connect()
+    cur = pg_conn.cursor()
+    cur.execute("CREATE TABLE bar (id integer, t text)")
+    cur.execute("INSERT INTO bar SELECT g, 'payload' FROM generate_series(1, 1000) g")
+    cur.execute("VACUUM bar")
+    cur.execute("CHECKPOINT")
+    assert get_stats() == (0, 0, 0, 0)
@@ -0,0 +1,108 @@
+import threading
+from typing import List
+
+import psycopg2.errors
+import pytest
+from fixtures.log_helper import log
+from fixtures.neon_fixtures import NeonEnv, Postgres
+from fixtures.utils import query_scalar
+
+
+# GiST and SP-GiST indexes are built without WAL-logging the pages one by one,
+# and then WAL-logged in bulk at the end of the build. A new compute reads the
+# index from the pageserver, so any page that missed the WAL shows up as a
+# wrong query result there.
+def check_index_scan(pg: Postgres, query: str, expected: int):
+    cur = pg.connect().cursor()
+    cur.execute("SET enable_seqscan = off")
+    cur.execute("SET enable_bitmapscan = off")
+    assert query_scalar(cur, query) == expected
+
+
+#
+# Build indexes on two tables at the same time, in two backends, and two
+# indexes in one transaction of a single backend.
+#
+def test_unlogged_build_concurrent(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_unlogged_build_concurrent", "empty")
+    pg = env.postgres.create_start("test_unlogged_build_concurrent")
+
+    cur = pg.connect().cursor()
+    for table in ["t1", "t2"]:
+        cur.execute(f"CREATE TABLE {table} (id integer, p point)")
+        cur.execute(f"INSERT INTO {table} SELECT g, point(g, g) FROM generate_series(1, 100000) g")
+
+    errors: List[Exception] = []
+
+    def build_index(table: str):
+        try:
+            with pg.connect().cursor() as c:
+                c.execute(f"CREATE INDEX {table}_spgist ON {table} USING spgist (p)")
+        except Exception as e:
+            errors.append(e)
+
+    threads = [threading.Thread(target=build_index, args=(table,)) for table in ["t1", "t2"]]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert errors == []
+
+    cur.execute("BEGIN")
+    cur.execute("CREATE INDEX t1_gist ON t1 USING gist (box(p, p))")
+    cur.execute("CREATE INDEX t2_gist ON t2 USING gist (box(p, p))")
+    cur.execute("COMMIT")
+    pg.stop()
+
+    pg = env.postgres.create_start("test_unlogged_build_concurrent")
+    for table in ["t1", "t2"]:
+        check_index_scan(pg, f"SELECT count(*) FROM {table} WHERE p <@ box '(0,0),(500,500)'", 500)
+        check_index_scan(
+            pg, f"SELECT count(*) FROM {table} WHERE box(p, p) && box '(0,0),(500,500)'", 500
+        )
+
+
+#
+# Abort a build in a subtransaction, and build the index again in the same
+# transaction. The aborted build must not be mistaken for the new one, nor
+# leave anything behind that fails the commit.
+#
+def test_unlogged_build_subxact_abort(neon_simple_env: NeonEnv):
+    env = neon_simple_env
+
+    env.neon_cli.create_branch("test_unlogged_build_subxact_abort", "empty")
+    pg = env.postgres.create_start("test_unlogged_build_subxact_abort")
+
+    cur = pg.connect().cursor()
+    cur.execute("CREATE TABLE t (id integer, p point)")
+    cur.execute("INSERT INTO t SELECT g, point(g, g) FROM generate_series(1, 100000) g")
+
+    cur.execute("BEGIN")
+    cur.execute("SAVEPOINT s")
+    # Fails with division by zero halfway through the build
+    with pytest.raises(psycopg2.errors.DivisionByZero):
+        cur.execute("CREATE INDEX t_broken ON t USING spgist (point(id, 1.0 / (id - 50000)))")
+    cur.execute("ROLLBACK TO SAVEPOINT s")
+
+    cur.execute("SAVEPOINT s2")
+    cur.execute("CREATE INDEX t_spgist ON t USING spgist (p)")
+    cur.execute("RELEASE SAVEPOINT s2")
+    cur.execute("COMMIT")
+
+    # A build aborted with the whole transaction is forgotten too
+    cur.execute("BEGIN")
+    cur.execute("CREATE INDEX t_gist ON t USING gist (box(p, p))")
+    cur.execute("ROLLBACK")
+    cur.execute("CREATE INDEX t_gist ON t USING gist (box(p, p))")
+
+    cur.execute("SELECT relname FROM pg_class WHERE relname LIKE 't\\_%' ORDER BY relname")
+    indexes = [row[0] for row in cur.fetchall()]
+    log.info(f"indexes after the aborted builds: {indexes}")
+    assert indexes == ["t_gist", "t_spgist"]
+    pg.stop()
+
+    pg = env.postgres.create_start("test_unlogged_build_subxact_abort")
+    check_index_scan(pg, "SELECT count(*) FROM t WHERE p <@ box '(0,0),(500,500)'", 500)
+    check_index_scan(pg, "SELECT count(*) FROM t WHERE box(p, p) && box '(0,0),(500,500)'", 500)
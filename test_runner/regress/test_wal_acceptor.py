@@ -13,6 +13,7 @@ from functools import partial
 from pathlib import Path
 from typing import Any, List, Optional
 
+import psycopg2.errors
 import pytest
 from fixtures.log_helper import log
 from fixtures.neon_fixtures import (
@@ -35,7 +36,7 @@ from fixtures.neon_fixtures import (
     wait_for_upload,
 )
 from fixtures.types import Lsn, TenantId, TimelineId
-from fixtures.utils import get_dir_size, query_scalar, start_in_background
+from fixtures.utils import get_dir_size, query_scalar, start_in_background, wait_until
 
 
 def wait_lsn_force_checkpoint(
@@ -257,6 +258,232 @@ def test_restarts(neon_env_builder: NeonEnvBuilder):
     assert query_scalar(cur, "SELECT sum(key) FROM t") == 500500
 
 
+# Check that WAL streamed through the memory-mapped WAL segments reaches the
+# safekeepers intact, across several segment switches.
+def test_mmap_wal(neon_env_builder: NeonEnvBuilder):
+    neon_env_builder.num_safekeepers = 3
+    env = neon_env_builder.init_start()
+
+    env.neon_cli.create_branch("test_mmap_wal")
+    pg = env.postgres.create_start("test_mmap_wal", config_lines=["neon.walproposer_mmap_wal=on"])
+
+    cur = pg.connect().cursor()
+    cur.execute("CREATE TABLE t(key int primary key, value text)")
+    # about 60 MB of WAL, more than three 16 MB segments
+    cur.execute("INSERT INTO t SELECT generate_series(1, 500000), 'payload'")
+    cur.execute("INSERT INTO t values (500001, 'payload')")
+    pg.stop()
+
+    # The new compute gets the data from the pageserver, which got it from
+    # the safekeepers
+    pg = env.postgres.create_start("test_mmap_wal")
+    cur = pg.connect().cursor()
+    assert query_scalar(cur, "SELECT count(*) FROM t") == 500001
+
+
+# Check that in quorum durability mode fsync is turned off, that commits wait
+# for the safekeeper quorum instead, and that committed data survives a crash
+# of the compute in the safekeepers.
+def test_quorum_wal_durability(neon_env_builder: NeonEnvBuilder, pg_bin: PgBin):
+    neon_env_builder.num_safekeepers = 3
+    env = neon_env_builder.init_start()
+
+    env.neon_cli.create_branch("test_quorum_wal_durability")
+    pg = env.postgres.create_start(
+        "test_quorum_wal_durability", config_lines=["fsync=on", "neon.wal_durability=quorum"]
+    )
+
+    cur = pg.connect().cursor()
+    assert query_scalar(cur, "SHOW fsync") == "off"
+    cur.execute("CREATE TABLE t(key int primary key, value text)")
+    for i in range(99):
+        cur.execute("INSERT INTO t values (%s, 'payload')", (i,))
+
+    # Without a quorum of safekeepers, a commit must not return
+    env.safekeepers[1].stop()
+    env.safekeepers[2].stop()
+    commit_done = threading.Event()
+
+    def commit():
+        with closing(pg.connect()) as conn:
+            conn.cursor().execute("INSERT INTO t values (99, 'payload')")
+        commit_done.set()
+
+    committer = threading.Thread(target=commit)
+    committer.start()
+    time.sleep(3)
+    assert not commit_done.is_set()
+
+    env.safekeepers[1].start()
+    env.safekeepers[2].start()
+    committer.join(60)
+    assert commit_done.is_set()
+
+    # Crash the compute, so that there's no shutdown checkpoint and no chance
+    # to stream the rest of the WAL to the safekeepers
+    pg_bin.run(["pg_ctl", "-D", pg.pg_data_dir_path(), "-m", "immediate", "-w", "stop"])
+    pg.check_stop_result = False
+    pg.stop()
+
+    # A new node, so that nothing is recovered from the old local WAL
+    pg = env.postgres.create_start(
+        "test_quorum_wal_durability", node_name="test_quorum_wal_durability_new"
+    )
+    cur = pg.connect().cursor()
+    assert query_scalar(cur, "SELECT count(*) FROM t") == 100
+    assert query_scalar(cur, "SELECT count(*) FROM t WHERE value <> 'payload'") == 0
+
+
+# Check that WAL sent to safekeepers with compression arrives intact, and
+# that the compressed messages are accepted by the safekeepers.
+def test_compressed_wal(neon_env_builder: NeonEnvBuilder):
+    neon_env_builder.num_safekeepers = 3
+    env = neon_env_builder.init_start()
+
+    env.neon_cli.create_branch("test_compressed_wal")
+    pg = env.postgres.create_start(
+        "test_compressed_wal", config_lines=["neon.walproposer_compression=pglz"]
+    )
+
+    cur = pg.connect().cursor()
+    cur.execute("CREATE TABLE t(key int primary key, value text)")
+    cur.execute("INSERT INTO t SELECT generate_series(1, 100000), repeat('payload', 10)")
+    cur.execute("CHECKPOINT")
+    # full page images after the checkpoint
+    cur.execute("UPDATE t SET value = 'updated'")
+    pg.stop()
+
+    pg = env.postgres.create_start("test_compressed_wal")
+    cur = pg.connect().cursor()
+    assert query_scalar(cur, "SELECT count(*) FROM t WHERE value = 'updated'") == 100000
+
+
+# Check that many small commits go through with send coalescing enabled.
+def test_send_coalescing(neon_env_builder: NeonEnvBuilder):
+    neon_env_builder.num_safekeepers = 3
+    env = neon_env_builder.init_start()
+
+    env.neon_cli.create_branch("test_send_coalescing")
+    pg = env.postgres.create_start(
+        "test_send_coalescing", config_lines=["neon.walproposer_coalesce_max_delay=2000"]
+    )
+
+    cur = pg.connect().cursor()
+    cur.execute("CREATE TABLE t(key int primary key, value text)")
+    for i in range(1000):
+        cur.execute("INSERT INTO t values (%s, 'payload');", (i + 1,))
+    pg.stop()
+
+    pg = env.postgres.create_start("test_send_coalescing")
+    cur = pg.connect().cursor()
+    assert query_scalar(cur, "SELECT sum(key) FROM t") == 500500
+
+
+# Check that a sub-millisecond neon.walproposer_coalesce_max_delay doesn't hold
+# commits for longer than that.
+def test_send_coalescing_latency(neon_env_builder: NeonEnvBuilder):
+    neon_env_builder.num_safekeepers = 3
+    env = neon_env_builder.init_start()
+
+    env.neon_cli.create_branch("test_send_coalescing_latency")
+    pg = env.postgres.create_start("test_send_coalescing_latency")
+
+    cur = pg.connect().cursor()
+    cur.execute("CREATE TABLE t(key int primary key, value text)")
+
+    def median_commit_latency_ms(first_key: int) -> float:
+        latencies = []
+        for i in range(first_key, first_key + 500):
+            started = time.monotonic()
+            cur.execute("INSERT INTO t values (%s, 'payload')", (i,))
+            latencies.append((time.monotonic() - started) * 1000)
+        latencies.sort()
+        return latencies[len(latencies) // 2]
+
+    without_coalescing = median_commit_latency_ms(0)
+
+    pg.config(["neon.walproposer_coalesce_max_delay=500"])
+    cur.execute("SELECT pg_reload_conf()")
+    time.sleep(1)
+    with_coalescing = median_commit_latency_ms(1000)
+
+    log.info(
+        f"median commit latency {without_coalescing:.3f} ms without coalescing, "
+        f"{with_coalescing:.3f} ms with a 500 us limit"
+    )
+    assert with_coalescing < without_coalescing + 0.5
+
+
+# Check that neon_safekeeper_stats() reports the connections to safekeepers,
+# including a stopped one.
+def test_safekeeper_stats(neon_env_builder: NeonEnvBuilder):
+    neon_env_builder.num_safekeepers = 3
+    env = neon_env_builder.init_start()
+
+    env.neon_cli.create_branch("test_safekeeper_stats")
+    pg = env.postgres.create_start("test_safekeeper_stats")
+    env.safekeepers[2].stop()
+
+    cur = pg.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE TABLE t(key int primary key, value text)")
+    for i in range(100):
+        cur.execute("INSERT INTO t values (%s, 'payload');", (i + 1,))
+
+    cur.execute("SELECT safekeeper, state, bytes_sent, rtt_histogram FROM neon_safekeeper_stats()")
+    rows = cur.fetchall()
+    log.info(f"safekeeper stats: {rows}")
+    assert len(rows) == 3
+
+    stopped_address = f"localhost:{env.safekeepers[2].port.pg}"
+    for address, state, bytes_sent, rtt_histogram in rows:
+        if address == stopped_address:
+            assert state != "active"
+        else:
+            assert state == "active"
+            assert bytes_sent > 0
+            assert sum(rtt_histogram) > 0
+
+    # The safekeeper addresses and errors are only visible to members of pg_monitor
+    cur.execute("CREATE ROLE monitor")
+    cur.execute("SET ROLE monitor")
+    with pytest.raises(psycopg2.errors.InsufficientPrivilege):
+        cur.execute("SELECT count(*) FROM neon_safekeeper_stats()")
+    cur.execute("RESET ROLE")
+    cur.execute("GRANT pg_monitor TO monitor")
+    cur.execute("SET ROLE monitor")
+    assert query_scalar(cur, "SELECT count(*) FROM neon_safekeeper_stats()") == 3
+    cur.execute("RESET ROLE")
+
+    # A safekeeper that hangs without closing the connection must show a
+    # growing flush lag, even though it produces no events.
+    env.safekeepers[2].start()
+
+    def stopped_safekeeper_active():
+        cur.execute(
+            "SELECT state FROM neon_safekeeper_stats() WHERE safekeeper = %s", (stopped_address,)
+        )
+        assert cur.fetchone()[0] == "active"
+
+    wait_until(30, 0.5, stopped_safekeeper_active)
+
+    with open(os.path.join(env.safekeepers[2].data_dir(), "safekeeper.pid")) as f:
+        pid = int(f.read())
+    os.kill(pid, signal.SIGSTOP)
+    try:
+        cur.execute("INSERT INTO t values (1000, 'payload')")
+        time.sleep(2)
+        cur.execute(
+            "SELECT flush_lag_us FROM neon_safekeeper_stats() WHERE safekeeper = %s",
+            (stopped_address,),
+        )
+        flush_lag_us = cur.fetchone()[0]
+        log.info(f"flush lag of the hung safekeeper: {flush_lag_us} us")
+        assert flush_lag_us >= 1_000_000
+    finally:
+        os.kill(pid, signal.SIGCONT)
+
+
 # Test that safekeepers push their info to the broker and learn peer status from it
 def test_broker(neon_env_builder: NeonEnvBuilder):
     neon_env_builder.num_safekeepers = 3
@@ -740,6 +967,67 @@ def test_sync_safekeepers(
     assert all(lsn_after_sync == lsn for lsn in lsn_after_append)
 
 
+# Check that sync-safekeepers returns the quorum position without waiting for
+# a hung safekeeper once neon.sync_safekeepers_straggler_timeout has passed.
+@pytest.mark.parametrize("straggler_timeout_ms", [0, 1000])
+def test_sync_safekeepers_straggler_timeout(
+    neon_env_builder: NeonEnvBuilder,
+    pg_bin: PgBin,
+    port_distributor: PortDistributor,
+    straggler_timeout_ms: int,
+):
+    neon_env_builder.num_safekeepers = 3
+    env = neon_env_builder.init_start()
+
+    tenant_id = TenantId.generate()
+    timeline_id = TimelineId.generate()
+
+    pgdata_dir = os.path.join(env.repo_dir, "proposer_pgdata")
+    pg = ProposerPostgres(
+        pgdata_dir, pg_bin, tenant_id, timeline_id, "127.0.0.1", port_distributor.get_port()
+    )
+    pg.create_dir_config(env.get_safekeeper_connstrs())
+    with open(pg.config_file_path(), "a") as f:
+        f.write(f"neon.sync_safekeepers_straggler_timeout = {straggler_timeout_ms}\n")
+
+    epoch_start_lsn = Lsn("0/16B9188")
+    lsn_after_append = []
+    for sk in env.safekeepers:
+        res = sk.append_logical_message(
+            tenant_id,
+            timeline_id,
+            {
+                "lm_prefix": "prefix",
+                "lm_message": "message",
+                "set_commit_lsn": True,
+                "send_proposer_elected": True,
+                "term": 2,
+                "begin_lsn": int(epoch_start_lsn),
+                "epoch_start_lsn": int(epoch_start_lsn),
+                "truncate_lsn": int(epoch_start_lsn),
+                "pg_version": int(env.pg_version) * 10000,
+            },
+        )
+        lsn_after_append.append(Lsn(res["inserted_wal"]["end_lsn"]))
+
+    # The hung safekeeper accepts the connection but never answers, so it
+    # doesn't count as offline, and without the timeout sync-safekeepers
+    # would wait for it forever.
+    with open(os.path.join(env.safekeepers[2].data_dir(), "safekeeper.pid")) as f:
+        pid = int(f.read())
+    os.kill(pid, signal.SIGSTOP)
+    try:
+        started = time.monotonic()
+        lsn_after_sync = pg.sync_safekeepers()
+        elapsed = time.monotonic() - started
+    finally:
+        os.kill(pid, signal.SIGCONT)
+
+    log.info(f"lsn after sync = {lsn_after_sync}, took {elapsed:.2f} s")
+    assert lsn_after_sync == lsn_after_append[0]
+    assert elapsed < straggler_timeout_ms / 1000 + 10
+
+
 @pytest.mark.parametrize("auth_enabled", [False, True])
 def test_timeline_status(neon_env_builder: NeonEnvBuilder, auth_enabled: bool):
     neon_env_builder.auth_enabled = auth_enabled